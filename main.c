@@ -1,495 +1,5782 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
-#define NUM_NODES 8
-#define TRANSACTIONS_PER_BLOCK 3
-#define REWARD_AMOUNT 1.0
-#define INITIAL_BALANCE 100.0
+#define NUM_NODES 8                   // Default node count, --nodes picks another
+#define MAX_REPORTED_NODES 8          // Nodes listed one by one in the reports; the rest are summarized
+#define MIN_BLOCK_TRANSACTIONS 3      // Pending transactions needed before miners start
+#define MAX_BLOCK_TRANSACTIONS 4096
+#define MAX_BLOCK_BYTES (1024 * 1024)  // Encoded header plus transactions
+#define MEMPOOL_INITIAL_CAPACITY 64
+#define MEMPOOL_MAX_TRANSACTIONS (1 << 18)   // The cheapest are evicted beyond this
+#define MEMPOOL_MAX_NONCE_AHEAD 64        // How far past its account's nonce a pending transaction may be
+#define SUBMISSION_QUEUE_CAPACITY 16384  // Power of two
+#define ADMISSION_BATCH 256
+#define ACCOUNT_TABLE_INITIAL_CAPACITY 64
+#define STATE_PAGE_SIZE 256           // Accounts per copy-on-write page
+#define STATE_HISTORY_DEPTH 64        // Best-chain blocks below the tip that keep their snapshot
+#define ADDRESS_SIZE 32               // An Ed25519 public key
+#define ADDRESS_NAME_SIZE 32
+#define ED25519_SEED_SIZE 32
+#define SIGNATURE_SIZE 64
+#define TX_BODY_SIZE (ADDRESS_SIZE * 2 + 32)           // What the sender signs
+#define TX_ENCODED_SIZE (TX_BODY_SIZE + SIGNATURE_SIZE)
+#define SIGNATURE_CACHE_SLOTS 65536   // Power of two
+#define STRAUS_MAX_POINTS 64          // Larger multi-scalar multiplications use Pippenger's buckets
+#define PARALLEL_VALIDATION_THRESHOLD 64   // Smaller blocks are checked inline
+#define PARALLEL_EXECUTION_THRESHOLD 1024  // Smaller blocks are applied inline
+#define COIN 100000000LL         // Base units of an amount in one coin
+#define CENT (COIN / 100)
+#define AMOUNT_TEXT_SIZE 32
+#define REWARD_AMOUNT (1 * COIN)
+#define INITIAL_BALANCE (100 * COIN)
+#define HASH_SIZE 32
+#define HASH_HEX_SIZE (HASH_SIZE * 2 + 1)
+#define DIFFICULTY_BITS 16      // Leading zero bits a block hash needs (target = 2^(256 - bits))
+#define MINER_THREADS 0         // Nonce search threads, 0 = online CPUs
+#define BLOCK_HEADER_SIZE 88
+#define HEADER_NONCE_OFFSET 80
+#define MERKLE_MAX_DEPTH 32
+#define ARENA_FIRST_CHUNK 4096             // Chunks double from here up to ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE (256 * 1024)
+#define CHAIN_INITIAL_CAPACITY 64
+#define MEMPOOL_CONFIRMATIONS 6        // Blocks on top of a transaction on every node before the pool forgets it
+#define BLOCK_LOG_SEGMENT_SIZE (64 * 1024 * 1024)  // A segment is closed once the next record would overflow it
+#define BLOCK_LOG_RECORD_HEADER 8                  // Payload length u32 | CRC-32 of the payload u32
+#define BLOCK_LOG_INDEX_ENTRY 48                   // hash | segment u32 | length u32 | offset u64
+#define PATH_SIZE 512
+#define CHECKPOINT_INTERVAL 1024       // Best-chain heights between state checkpoints
+#define CHECKPOINT_MAGIC 0x54504B43u   // "CKPT"
+#define CHECKPOINT_HEADER_SIZE (4 + 4 + 8 + 8 + HASH_SIZE + 8)
+#define CHECKPOINT_ACCOUNT_SIZE (ADDRESS_SIZE + 8 + 8)   // address | balance i64 | nonce u64
+#define LINK_LATENCY_MS 50.0           // One-way propagation delay of every link
+#define LINK_BANDWIDTH 1.25e6          // Bytes per simulated second (10 Mbit/s)
+#define LINK_DROP_RATE 0.0             // Probability that a message is lost
+#define SIM_SEED 0x5eed                // Default seed of the simulation's random stream
+#define SIM_EPOCH 1700000000           // Unix time at simulated time 0
+#define SIM_HASH_RATE 2e5              // Hashes per simulated second of the whole network, split evenly across the nodes
+#define MAX_ORPHAN_BLOCKS 16           // Blocks a node holds while it fetches their parent
+#define MESSAGE_HEADER_SIZE 24         // Framing charged to every message on the wire
 
+// Fixed-width binary account ID, the account's Ed25519 public key; names only exist in the display table
 typedef struct {
-    char sender[50];
-    char receiver[50];
-    double amount;
+    uint8_t bytes[ADDRESS_SIZE];
+} Address;
+
+// Money in whole base units, COIN to a coin, so every node computes the same balances
+typedef int64_t Amount;
+
+typedef struct {
+    Address sender;
+    Address receiver;
+    Amount amount;
+    Amount fee;                          // Paid to the miner on top of the amount; zero in a coinbase
+    uint64_t nonce;                      // The sender's transaction count before this one
     time_t timestamp;
+    uint8_t signature[SIGNATURE_SIZE];   // By the sender over the other fields; zero in a coinbase
 } Transaction;
 
+// Element of GF(2^255 - 19) in radix 2^51. Every operation carries its result, so limbs stay
+// below 2^52 and any two elements can go straight into a multiplication.
+typedef struct {
+    uint64_t v[5];
+} Fe;
+
+// Point of edwards25519 in extended coordinates: x = X/Z, y = Y/Z, x*y = T/Z
+typedef struct {
+    Fe X, Y, Z, T;
+} GePoint;
+
+// An address decoded as a public key, done once when the account is created
+typedef struct {
+    GePoint point;
+    bool valid;         // False when the address is not a point on the curve
+} AccountKey;
+
+// Open-addressing (linear probing) index from an Address to its position in a dense array.
+// Slots pack (hash tag << 32) | (entry + 1), 0 meaning empty.
+typedef struct {
+    uint64_t* slots;
+    size_t mask;
+} AddressIndex;
+
+// Address -> account id, shared by every node. Append-only, so an id names the same account in
+// every state snapshot; ids are assigned in the order accounts first appear.
+typedef struct {
+    Address* addresses;       // By id
+    AccountKey* keys;         // By id
+    size_t count;
+    size_t capacity;
+    AddressIndex index;
+    pthread_rwlock_t lock;    // Shared by validators and admission, exclusive to add accounts
+} AccountDirectory;
+
+// Balances and nonces of STATE_PAGE_SIZE consecutive account ids, shared between snapshots until written
+typedef struct {
+    atomic_int refs;
+    Amount balances[STATE_PAGE_SIZE];
+    uint64_t nonces[STATE_PAGE_SIZE];    // Next nonce each account may use
+    uint8_t exists[STATE_PAGE_SIZE];
+} StatePage;
+
+// One version of a node's balances. Immutable once published: a child version shares every
+// page of its parent and copies only the pages a block writes to.
+typedef struct {
+    atomic_int refs;
+    size_t page_count;
+    StatePage** pages;   // NULL where no account of this version lives yet
+} StateSnapshot;
+
+typedef struct {
+    Address address;
+    char name[ADDRESS_NAME_SIZE];
+    uint8_t seed[ED25519_SEED_SIZE];   // The account's signing key
+    uint64_t next_nonce;               // For the next transaction this process signs
+} AddressName;
+
+// Display names for interned addresses, and the keys to sign for them
 typedef struct {
-    char address[50];
-    double balance;
-} Account;
+    AddressName* entries;
+    size_t count;
+    size_t entry_capacity;
+    AddressIndex index;
+} NameTable;
 
 typedef struct Block {
     int index;
     time_t timestamp;
-    Transaction transactions[TRANSACTIONS_PER_BLOCK];
-    char previous_hash[65];
-    char hash[65];
-    struct Block* next;
+    uint8_t previous_hash[HASH_SIZE];
+    uint8_t merkle_root[HASH_SIZE];
+    uint32_t difficulty_bits;
+    uint64_t nonce;
+    uint8_t hash[HASH_SIZE];
+    atomic_int refs;              // Handles held by chains and by the miner that built it
+    int tx_count;
+    Transaction transactions[];   // tx_count entries, allocated with the block
 } Block;
 
-typedef struct {
-    Block* head;
-    Block* tail;
-    int length;
-    long current_proof;  // Moved proof to blockchain level
-    pthread_mutex_t lock;
-} Blockchain;
+typedef enum {
+    TX_VALID,
+    TX_REPLACED,             // Valid, and outbids the pending transaction with its nonce
+    TX_BAD_SIGNATURE,
+    TX_BAD_AMOUNT,
+    TX_INSUFFICIENT_FUNDS,
+    TX_OVERSPENT,            // Affordable alone, but not on top of the sender's pending transactions
+    TX_STALE_NONCE,          // The sender already used the nonce
+    TX_NONCE_TOO_FAR,        // More than MEMPOOL_MAX_NONCE_AHEAD past the sender's nonce
+    TX_UNDERPRICED           // Pays too little to enter the pool or to replace what it holds
+} TransactionVerdict;
+
+#define POOL_NONE UINT32_MAX
+
+// A pending transaction, kept in the pool's slab and referred to by its index there
+typedef struct {
+    Transaction tx;
+    uint64_t seq;          // Admission order: of two equal fees the older goes first
+    uint32_t sender;       // Account id of tx.sender
+    uint32_t heap_index;   // Position in the eviction heap; the next free slot while unused
+} PoolEntry;
+
+// One account's pending transactions. Nonces may have gaps; a block takes the consecutive run
+// that starts at the account's nonce in the miner's state.
+typedef struct {
+    uint32_t* entries;     // Sorted by nonce
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t best;         // The entry that would be mined first, which ranks the sender
+    uint32_t ready_index;  // Position in the ready heap, POOL_NONE while the account has nothing pending
+    uint64_t settled_nonce;  // Account nonce in the state admission last checked against
+    Amount reserved;         // Amount plus fee of the entries from settled_nonce on, not mined in that state
+} PoolSender;
+
+// A sender's position in the state a transaction is admitted against
+typedef struct {
+    size_t account;
+    Amount balance;
+    uint64_t nonce;
+} SenderState;
+
+// Binary heap of pool indices; every item records its position, so it can be re-sorted or
+// removed in place
+typedef struct {
+    uint32_t* items;
+    uint32_t count;
+    uint32_t capacity;
+} PoolHeap;
+
+// Pending transactions ranked by fee. They all encode to the same size, so the fee is the fee
+// rate. The eviction heap keeps the cheapest on top and the ready heap the sender whose best
+// transaction pays most; inserting, replacing and evicting are O(log n). Each sender also
+// reserves what its pending transactions spend, so admission sees the balance they leave.
+typedef struct {
+    PoolEntry* entries;
+    uint32_t entry_capacity;
+    uint32_t free_head;    // Unused slots, chained through heap_index
+    uint32_t count;
+    PoolSender* senders;   // By account id
+    uint32_t sender_count;
+    PoolHeap evict;        // Entries, cheapest first, then newest first
+    PoolHeap ready;        // Senders with something pending
+    uint64_t next_seq;
+} Mempool;
+
+// Bounded lock-free MPMC ring (Vyukov): each slot's sequence number tells producers and
+// consumers whether it is free for the current lap, so neither side ever takes a lock
+typedef struct {
+    atomic_size_t sequence;
+    Transaction tx;
+} TxQueueSlot;
+
+typedef struct {
+    TxQueueSlot* slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} TxQueue;
+
+// Growable byte buffer, reset and reused instead of reallocated for every encoding
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} ByteBuffer;
+
+// Binary Merkle tree stored level by level: leaves first, root last.
+// A level with an odd width promotes its last node to the next level unchanged.
+typedef struct {
+    uint8_t (*nodes)[HASH_SIZE];
+    int leaf_count;
+    int capacity;
+} MerkleTree;
+
+// Sibling hashes from the leaf up to (but excluding) the root
+typedef struct {
+    int leaf_index;
+    int leaf_count;
+    int length;
+    uint8_t siblings[MERKLE_MAX_DEPTH][HASH_SIZE];
+} MerkleProof;
+
+// Bump allocator over a list of chunks; objects are never freed one by one, only the whole arena.
+// Not thread-safe: each arena has a single owner (a node's miner, or whoever holds its chain lock).
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+    _Alignas(16) unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* chunks;   // Newest first; allocations come from the head
+    size_t allocations;
+    size_t bytes;         // Requested, before alignment
+    size_t reserved;      // Chunk capacity obtained from malloc
+    size_t chunk_count;
+} Arena;
+
+// Open-addressing index from a block hash to its tree entry, same slot packing as AddressIndex
+typedef struct {
+    uint64_t* slots;
+    size_t mask;
+} BlockHashIndex;
+
+// One block in a node's block tree; side branches stay so a heavier branch can take over later.
+// Each entry holds one reference to its shared block.
+typedef struct {
+    const Block* block;
+    int parent;           // Entry index, -1 for genesis
+    uint64_t work;        // Expected hashes from genesis up to and including this block
+    StateSnapshot* state; // Balances after this block; released once it is deep in the best chain
+} TreeEntry;
+
+// A node's block tree and its best chain (most cumulative work), indexed by height.
+// Only valid blocks enter the tree, each with the state it produces.
+typedef struct {
+    TreeEntry* entries;
+    int entry_count;
+    int entry_capacity;       // Half the index slots, so the index stays at most half full
+    BlockHashIndex by_hash;   // Hash -> entry, across every branch
+    int* active;              // active[h] is the entry at height h on the best chain
+    int length;
+    int active_capacity;
+    int base;                 // Height of the tree's root: 0, or the checkpoint a restart loaded
+    pthread_mutex_t lock;     // Guards all of the above
+} Blockchain;
+
+// Every block lives once in memory, however many chains hold it; these count what is live
+typedef struct {
+    atomic_size_t blocks;
+    atomic_size_t bytes;
+} BlockStore;
+
+// Merkle leaf hashes of transactions whose signature verified, so a transaction the pool admitted
+// is not checked again for every block and every node that carries it. Direct-mapped: a new
+// entry replaces whatever held its slot.
+typedef struct {
+    uint8_t (*slots)[HASH_SIZE];  // All zero when empty
+    size_t mask;
+    pthread_rwlock_t lock;
+} SignatureCache;
+
+// Runs the same task on every worker and waits for all of them to return
+typedef void (*PoolTask)(void* arg, int worker, int workers);
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+    WorkerPool* pool;
+    int index;
+} PoolWorker;
+
+struct WorkerPool {
+    pthread_t* threads;
+    PoolWorker* workers;
+    int size;
+    pthread_mutex_t run_lock;   // One task at a time per pool
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    PoolTask task;
+    void* arg;
+    unsigned long generation;
+    int pending;
+    bool shutdown;
+};
+
+// Where one record of a block log lives
+typedef struct {
+    uint8_t hash[HASH_SIZE];
+    uint32_t segment;
+    uint32_t length;     // Payload bytes, after the record header
+    uint64_t offset;     // Of the record header within its segment
+} BlockLogEntry;
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} MappedFile;
+
+// A node's blocks in the order it accepted them, as numbered segment files of records plus an
+// index file with one entry per record. Written through stdio, read back through mmap.
+typedef struct {
+    char dir[PATH_SIZE - 32];   // Empty when the node is not persistent; leaves room for file names
+    FILE* segment;              // Segment being appended to
+    FILE* index;
+    uint32_t segment_id;
+    uint64_t segment_size;
+    BlockLogEntry* entries;
+    size_t count;
+    size_t capacity;
+    MappedFile* maps;           // By segment, mapped on first read and remapped once it grows
+    uint32_t map_count;
+} BlockLog;
+
+typedef enum {
+    MESSAGE_BLOCK,       // A block
+    MESSAGE_GET_BLOCK    // Asks the receiver to send the block with `hash`
+} MessageType;
+
+typedef struct Message {
+    MessageType type;
+    int from;
+    int to;
+    const Block* block;           // MESSAGE_BLOCK: a reference owned by the message
+    uint8_t hash[HASH_SIZE];      // MESSAGE_GET_BLOCK
+    double sent_at;               // Simulated milliseconds
+    double deliver_at;
+} Message;
+
+// One direction between two nodes. Transmissions on a link are serialized: a message starts
+// once the previous one has been put on the wire, takes size / bandwidth to send and then
+// `latency_ms` to arrive.
+typedef struct {
+    double latency_ms;
+    double bandwidth;             // Bytes per simulated second
+    double drop_rate;
+    double busy_until;            // Simulated time the link finishes its queued transmissions
+} Link;
+
+// A node's outgoing links, created on first use from the defaults
+typedef struct {
+    int to;                       // -1 for an empty slot
+    Link link;
+} LinkSlot;
+
+typedef struct {
+    LinkSlot* slots;              // Open addressing on `to`
+    size_t capacity;              // Power of two
+    size_t count;
+} LinkTable;
+
+// Per-node message counters, summed when the network stops
+typedef struct {
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t delivered;
+    uint64_t bytes;
+    double total_delay_ms;
+} Traffic;
+
+// Settings for links nobody configured. Messages in flight are delivery events in the scheduler.
+typedef struct {
+    Link defaults;
+    double lookahead_ms;          // Shortest latency of any link
+} Transport;
+
+typedef enum {
+    EVENT_TRANSACTION,    // A client submits `tx`
+    EVENT_DELIVERY,       // `msg` reaches its receiver
+    EVENT_BLOCK_FOUND     // `node` finds a nonce for the candidate it started in `generation`
+} EventType;
+
+typedef struct {
+    double at;                    // Simulated milliseconds
+    uint64_t seq;                 // Orders events due at the same time by when they were scheduled
+    EventType type;
+    int node;
+    unsigned generation;
+    Message* msg;                 // Owned by the event
+    Transaction tx;
+} Event;
+
+typedef struct {
+    Event* heap;                  // Min-heap on (at, seq), or in append order for an outbox
+    size_t count;
+    size_t capacity;
+} EventQueue;
+
+// Pending events in time order. Node events are run in rounds: no message arrives sooner than
+// the shortest link latency after it is sent, so the events due within that lookahead of the
+// earliest one cannot affect each other across nodes, and every node with events in the round
+// runs them as one task on the node pool. Transaction arrivals are run alone, in between.
+typedef struct {
+    EventQueue events;            // Deliveries and mining completions
+    EventQueue arrivals;          // Transactions
+    double now_ms;
+    double round_end;             // Events of the running round are due before this
+    uint64_t next_seq;
+    uint64_t processed;
+    uint64_t rounds;
+} Scheduler;
+
+typedef struct {
+    int id;
+    Address address;
+    Blockchain blockchain;
+    const Block* orphans[MAX_ORPHAN_BLOCKS];  // Blocks whose parent is being fetched
+    int orphan_count;
+    BlockLog log;                   // Appended under the blockchain lock
+    pthread_mutex_t checkpoint_lock;
+    int checkpoint_height;          // Of the newest checkpoint written, guarded by checkpoint_lock
+    MerkleTree merkle;              // Candidate block being mined
+    Block* candidate;               // Reused for every candidate, published into `blocks` once mined
+    size_t candidate_capacity;
+    Arena blocks;                   // Blocks this node published; released with the network
+    bool mining;                    // `candidate` is being mined; its completion is scheduled
+    unsigned mining_generation;     // Bumped when a candidate is abandoned, so its completion is ignored
+    bool skipping;                  // Malicious node sitting out until its tip moves
+    atomic_uint_fast64_t tip_work;  // Copy of the tip entry's work, readable without the lock
+    int nonce_searches;             // Candidates whose nonce was actually searched for
+    int stale_candidates;           // Searches abandoned because the tip moved
+    int orphaned_blocks;            // Mined blocks a reorg took off our best chain
+    int reorgs;                     // Tip switches to another branch, guarded by the blockchain lock
+    int deepest_reorg;              // Most blocks one reorg took off the best chain
+    bool is_malicious;
+    uint64_t rng;                   // The node's own random stream, so rounds stay reproducible
+    LinkTable links;                // Outgoing
+    Traffic traffic;
+    EventQueue mailbox;             // Events of the current round, in order
+    EventQueue outbox;              // Events scheduled during the round for later ones
+    double now_ms;                  // Time of the event being run
+    uint64_t next_seq;
+    ByteBuffer output;              // Printed after the round, in node order
+    bool tip_moved;                 // During the round
+} Node;
+
+NameTable address_names = {NULL, 0, 0, {NULL, 0}};
+pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+Mempool mempool;
+pthread_mutex_t transaction_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Submissions go through a lock-free queue; one admission thread validates them into the mempool
+TxQueue submission_queue;
+pthread_t admission_thread;
+atomic_bool admission_running = false;
+atomic_bool admission_waiting = false;
+atomic_size_t admitted_count = 0;
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;    // Wakes the idle admission thread
+pthread_cond_t admitted_cond = PTHREAD_COND_INITIALIZER;     // Signals progress to wait_for_admission
+
+Node* network = NULL;
+int num_nodes = NUM_NODES;
+AccountDirectory accounts;    // Account ids for every snapshot on every node
+BlockStore block_store;
+WorkerPool validation_pool;   // Shared by every node for the per-transaction stage
+SignatureCache signature_cache;
+WorkerPool mining_pool;       // Nonce search for whichever node completes a block
+// Real work done by mining_pool, one entry per search whichever node asked for it
+int mining_searches = 0;
+uint64_t mining_hashes = 0;
+double mining_seconds = 0.0;
+pthread_mutex_t mining_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+WorkerPool node_pool;         // Runs the nodes of a round
+_Thread_local Node* current_node = NULL;   // Node whose events this thread is running
+Transport transport;
+Scheduler scheduler;
+uint64_t sim_seed = SIM_SEED;
+uint64_t address_hash_key = 0;   // Per process, see init_address_hash_key
+int difficulty_bits = DIFFICULTY_BITS;
+int miner_threads = MINER_THREADS;
+const char* data_dir = NULL;  // Where nodes persist their chains; NULL keeps them in memory only
+int max_block_transactions = MAX_BLOCK_TRANSACTIONS;
+size_t max_block_bytes = MAX_BLOCK_BYTES;
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;      // Total bytes absorbed so far
+    uint8_t buffer[64];
+    size_t buffer_len;
+} Sha256Ctx;
+
+// Compresses `count` consecutive 64-byte blocks into `state`
+typedef void (*Sha256CompressFn)(uint32_t state[8], const uint8_t* blocks, size_t count);
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_compress_scalar(uint32_t state[8], const uint8_t* blocks, size_t count) {
+    while (count--) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)blocks[i * 4] << 24) | ((uint32_t)blocks[i * 4 + 1] << 16) |
+                   ((uint32_t)blocks[i * 4 + 2] << 8) | (uint32_t)blocks[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        blocks += 64;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Intel SHA extensions: each sha256rnds2 performs two rounds, state is kept as ABEF/CDGH
+__attribute__((target("sha,sse4.1")))
+void sha256_compress_shani(uint32_t state[8], const uint8_t* blocks, size_t count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (count--) {
+        __m128i abef_save = state0;
+        __m128i cdgh_save = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + i * 16)), byte_swap);
+            } else {
+                // W[t] = W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2]), four words at a time
+                __m128i x = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                w[i & 3] = _mm_sha256msg2_epu32(x, w[(i + 3) & 3]);
+            }
+
+            __m128i msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        blocks += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif
+
+Sha256CompressFn sha256_compress = sha256_compress_scalar;
+const char* sha256_engine_name = "scalar";
+
+// Picks the fastest compression function supported by the CPU we are running on
+void sha256_select_engine() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    bool has_ssse3_sse41 = false;
+    bool has_sha = false;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        has_ssse3_sse41 = (ecx & (1u << 9)) && (ecx & (1u << 19));
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        has_sha = (ebx & (1u << 29)) != 0;
+    }
+    if (has_ssse3_sse41 && has_sha) {
+        sha256_compress = sha256_compress_shani;
+        sha256_engine_name = "sha-ni";
+        return;
+    }
+#endif
+    sha256_compress = sha256_compress_scalar;
+    sha256_engine_name = "scalar";
+}
+
+void sha256_init(Sha256Ctx* ctx) {
+    memcpy(ctx->state, sha256_initial_state, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->buffer_len = 0;
+}
+
+void sha256_update(Sha256Ctx* ctx, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    ctx->length += len;
+
+    if (ctx->buffer_len > 0) {
+        size_t take = 64 - ctx->buffer_len;
+        if (take > len) take = len;
+        memcpy(ctx->buffer + ctx->buffer_len, bytes, take);
+        ctx->buffer_len += take;
+        bytes += take;
+        len -= take;
+        if (ctx->buffer_len < 64) return;
+        sha256_compress(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+
+    // Whole blocks go straight from the caller's memory
+    if (len >= 64) {
+        sha256_compress(ctx->state, bytes, len / 64);
+        bytes += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buffer, bytes, len);
+    ctx->buffer_len = len;
+}
+
+void sha256_final(Sha256Ctx* ctx, uint8_t out[HASH_SIZE]) {
+    uint64_t bit_length = ctx->length * 8;
+
+    ctx->buffer[ctx->buffer_len++] = 0x80;
+    if (ctx->buffer_len > 56) {
+        memset(ctx->buffer + ctx->buffer_len, 0, 64 - ctx->buffer_len);
+        sha256_compress(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+    memset(ctx->buffer + ctx->buffer_len, 0, 56 - ctx->buffer_len);
+    for (int i = 0; i < 8; i++) {
+        ctx->buffer[63 - i] = (uint8_t)(bit_length >> (i * 8));
+    }
+    sha256_compress(ctx->state, ctx->buffer, 1);
+
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void sha256(const void* data, size_t len, uint8_t out[HASH_SIZE]) {
+    Sha256Ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, out);
+}
+
+typedef struct {
+    uint64_t state[8];
+    uint64_t length;      // Total bytes absorbed so far
+    uint8_t buffer[128];
+    size_t buffer_len;
+} Sha512Ctx;
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint64_t sha512_initial_state[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+// Only Ed25519 uses SHA-512, on short inputs, so there is just the scalar engine
+void sha512_compress(uint64_t state[8], const uint8_t* blocks, size_t count) {
+    while (count--) {
+        uint64_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = 0;
+            for (int j = 0; j < 8; j++) {
+                w[i] = (w[i] << 8) | blocks[i * 8 + j];
+            }
+        }
+        for (int i = 16; i < 80; i++) {
+            uint64_t s0 = ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+            uint64_t s1 = ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 80; i++) {
+            uint64_t t1 = h + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41)) +
+                          ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+            uint64_t t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        blocks += 128;
+    }
+}
+
+void sha512_init(Sha512Ctx* ctx) {
+    memcpy(ctx->state, sha512_initial_state, sizeof(ctx->state));
+    ctx->length = 0;
+    ctx->buffer_len = 0;
+}
+
+void sha512_update(Sha512Ctx* ctx, const void* data, size_t len) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    ctx->length += len;
+
+    if (ctx->buffer_len > 0) {
+        size_t take = 128 - ctx->buffer_len;
+        if (take > len) take = len;
+        memcpy(ctx->buffer + ctx->buffer_len, bytes, take);
+        ctx->buffer_len += take;
+        bytes += take;
+        len -= take;
+        if (ctx->buffer_len < 128) return;
+        sha512_compress(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+
+    if (len >= 128) {
+        sha512_compress(ctx->state, bytes, len / 128);
+        bytes += len & ~(size_t)127;
+        len &= 127;
+    }
+
+    memcpy(ctx->buffer, bytes, len);
+    ctx->buffer_len = len;
+}
+
+// The length field is 128 bits; inputs here never need the upper half
+void sha512_final(Sha512Ctx* ctx, uint8_t out[64]) {
+    uint64_t bit_length = ctx->length * 8;
+
+    ctx->buffer[ctx->buffer_len++] = 0x80;
+    if (ctx->buffer_len > 112) {
+        memset(ctx->buffer + ctx->buffer_len, 0, 128 - ctx->buffer_len);
+        sha512_compress(ctx->state, ctx->buffer, 1);
+        ctx->buffer_len = 0;
+    }
+    memset(ctx->buffer + ctx->buffer_len, 0, 120 - ctx->buffer_len);
+    for (int i = 0; i < 8; i++) {
+        ctx->buffer[127 - i] = (uint8_t)(bit_length >> (i * 8));
+    }
+    sha512_compress(ctx->state, ctx->buffer, 1);
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            out[i * 8 + j] = (uint8_t)(ctx->state[i] >> (56 - j * 8));
+        }
+    }
+}
+
+void sha512(const void* data, size_t len, uint8_t out[64]) {
+    Sha512Ctx ctx;
+    sha512_init(&ctx);
+    sha512_update(&ctx, data, len);
+    sha512_final(&ctx, out);
+}
+
+// Hex is only produced when a hash needs to be displayed
+void hash_to_hex(const uint8_t hash[HASH_SIZE], char output[HASH_HEX_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < HASH_SIZE; i++) {
+        output[i * 2] = digits[hash[i] >> 4];
+        output[i * 2 + 1] = digits[hash[i] & 0x0f];
+    }
+    output[HASH_SIZE * 2] = '\0';
+}
+
+int online_cpus() {
+#ifdef _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#else
+    return 1;
+#endif
+}
+
+double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Simulated milliseconds since the network started, as seen by the node being run
+double sim_now_ms() {
+    return current_node ? current_node->now_ms : scheduler.now_ms;
+}
+
+// Wall-clock time as the simulation sees it, for timestamps
+time_t sim_time() {
+    return (time_t)SIM_EPOCH + (time_t)(sim_now_ms() / 1000.0);
+}
+
+void* worker_pool_thread(void* arg) {
+    PoolWorker* worker = (PoolWorker*)arg;
+    WorkerPool* pool = worker->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->shutdown) break;
+
+        seen = pool->generation;
+        PoolTask task = pool->task;
+        void* task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        task(task_arg, worker->index, pool->size);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void worker_pool_init(WorkerPool* pool, int size) {
+    pool->size = size > 0 ? size : 1;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * pool->size);
+    pool->workers = (PoolWorker*)malloc(sizeof(PoolWorker) * pool->size);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->task = NULL;
+    pool->arg = NULL;
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->shutdown = false;
+
+    for (int i = 0; i < pool->size; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_create(&pool->threads[i], NULL, worker_pool_thread, &pool->workers[i]);
+    }
+}
+
+void worker_pool_run(WorkerPool* pool, PoolTask task, void* arg) {
+    pthread_mutex_lock(&pool->run_lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->pending = pool->size;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void worker_pool_destroy(WorkerPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->size; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+bool hash_meets_difficulty(const uint8_t hash[HASH_SIZE], int bits) {
+    int full_bytes = bits / 8;
+    for (int i = 0; i < full_bytes; i++) {
+        if (hash[i] != 0) return false;
+    }
+    int remaining = bits % 8;
+    return remaining == 0 || (hash[full_bytes] >> (8 - remaining)) == 0;
+}
+
+void byte_buffer_init(ByteBuffer* buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void byte_buffer_free(ByteBuffer* buf) {
+    free(buf->data);
+    byte_buffer_init(buf);
+}
+
+uint8_t* byte_buffer_extend(ByteBuffer* buf, size_t len) {
+    if (buf->size + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (capacity < buf->size + len) capacity *= 2;
+        buf->data = (uint8_t*)realloc(buf->data, capacity);
+        buf->capacity = capacity;
+    }
+    uint8_t* out = buf->data + buf->size;
+    buf->size += len;
+    return out;
+}
+
+// Output of a node task is held until its round ends, so runs print in the same order
+void node_printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (current_node == NULL) {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (len > 0) {
+        char* out = (char*)byte_buffer_extend(&current_node->output, (size_t)len + 1);
+        vsnprintf(out, (size_t)len + 1, format, args);
+        current_node->output.size--;   // Drop the terminator
+    }
+    va_end(args);
+}
+
+// All multi-byte integers are encoded little-endian regardless of the host
+void put_u32_le(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out[i] = (uint8_t)(value >> (i * 8));
+}
+
+void put_u64_le(uint8_t* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out[i] = (uint8_t)(value >> (i * 8));
+}
+
+uint32_t get_u32_le(const uint8_t* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)in[i] << (i * 8);
+    return value;
+}
+
+uint64_t get_u64_le(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)in[i] << (i * 8);
+    return value;
+}
+
+void buffer_put_u64(ByteBuffer* buf, uint64_t value) {
+    put_u64_le(byte_buffer_extend(buf, 8), value);
+}
+
+typedef unsigned __int128 uint128_t;
+
+// Integer modulo the group order L, as little-endian 64-bit limbs
+typedef struct {
+    uint64_t limb[4];
+} Scalar;
+
+// One signature to check: `signature` by `public_key` over `message`
+typedef struct {
+    const uint8_t* public_key;
+    const GePoint* key;           // `public_key` already decoded, or NULL
+    const uint8_t* message;
+    size_t message_len;
+    const uint8_t* signature;
+} SignatureCheck;
+
+#define FE_MASK ((1ULL << 51) - 1)
+
+static const Fe fe_d2 = {{0x69b9426b2f159ULL, 0x35050762add7aULL, 0x3cf44c0038052ULL, 0x6738cc7407977ULL, 0x2406d9dc56dffULL}};
+static const Fe fe_d = {{0x34dca135978a3ULL, 0x1a8283b156ebdULL, 0x5e7a26001c029ULL, 0x739c663a03cbbULL, 0x52036cee2b6ffULL}};
+static const Fe fe_sqrtm1 = {{0x61b274a0ea0b0ULL, 0x0d5a5fc8f189dULL, 0x7ef5e9cbd0c60ULL, 0x78595a6804c9eULL, 0x2b8324804fc1dULL}};
+static const GePoint ge_base = {
+    {{0x62d608f25d51aULL, 0x412a4b4f6592aULL, 0x75b7171a4b31dULL, 0x1ff60527118feULL, 0x216936d3cd6e5ULL}},
+    {{0x6666666666658ULL, 0x4ccccccccccccULL, 0x1999999999999ULL, 0x3333333333333ULL, 0x6666666666666ULL}},
+    {{1, 0, 0, 0, 0}},
+    {{0x68ab3a5b7dda3ULL, 0x00eea2a5eadbbULL, 0x2af8df483c27eULL, 0x332b375274732ULL, 0x67875f0fd78b7ULL}}
+};
+static const Scalar sc_order = {{0x5812631a5cf5d3edULL, 0x14def9dea2f79cd6ULL, 0, 0x1000000000000000ULL}};
+static const uint64_t sc_barrett_mu[5] = {   // floor(2^512 / L)
+    0xed9ce5a30a2c131bULL, 0x2106215d086329a7ULL, 0xffffffffffffffebULL, 0xffffffffffffffffULL, 0xfULL
+};
+
+void fe_carry(Fe* h) {
+    uint64_t c;
+    c = h->v[0] >> 51; h->v[0] &= FE_MASK; h->v[1] += c;
+    c = h->v[1] >> 51; h->v[1] &= FE_MASK; h->v[2] += c;
+    c = h->v[2] >> 51; h->v[2] &= FE_MASK; h->v[3] += c;
+    c = h->v[3] >> 51; h->v[3] &= FE_MASK; h->v[4] += c;
+    c = h->v[4] >> 51; h->v[4] &= FE_MASK; h->v[0] += c * 19;
+}
+
+void fe_add(Fe* h, const Fe* f, const Fe* g) {
+    for (int i = 0; i < 5; i++) {
+        h->v[i] = f->v[i] + g->v[i];
+    }
+    fe_carry(h);
+}
+
+// Adds 2p first so no limb goes negative
+void fe_sub(Fe* h, const Fe* f, const Fe* g) {
+    h->v[0] = f->v[0] + 0xFFFFFFFFFFFDAULL - g->v[0];
+    for (int i = 1; i < 5; i++) {
+        h->v[i] = f->v[i] + 0xFFFFFFFFFFFFEULL - g->v[i];
+    }
+    fe_carry(h);
+}
+
+// Folds the five 128-bit column sums of a product back into limbs; 2^255 = 19 mod p
+void fe_reduce_wide(Fe* h, uint128_t r0, uint128_t r1, uint128_t r2, uint128_t r3, uint128_t r4) {
+    r1 += (uint64_t)(r0 >> 51);
+    r2 += (uint64_t)(r1 >> 51);
+    r3 += (uint64_t)(r2 >> 51);
+    r4 += (uint64_t)(r3 >> 51);
+    uint64_t h0 = ((uint64_t)r0 & FE_MASK) + (uint64_t)(r4 >> 51) * 19;
+    h->v[1] = ((uint64_t)r1 & FE_MASK) + (h0 >> 51);
+    h->v[0] = h0 & FE_MASK;
+    h->v[2] = (uint64_t)r2 & FE_MASK;
+    h->v[3] = (uint64_t)r3 & FE_MASK;
+    h->v[4] = (uint64_t)r4 & FE_MASK;
+}
+
+void fe_mul(Fe* h, const Fe* f, const Fe* g) {
+    uint64_t f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3], f4 = f->v[4];
+    uint64_t g0 = g->v[0], g1 = g->v[1], g2 = g->v[2], g3 = g->v[3], g4 = g->v[4];
+    uint64_t g1_19 = g1 * 19, g2_19 = g2 * 19, g3_19 = g3 * 19, g4_19 = g4 * 19;
+
+    uint128_t r0 = (uint128_t)f0 * g0 + (uint128_t)f1 * g4_19 + (uint128_t)f2 * g3_19 +
+                   (uint128_t)f3 * g2_19 + (uint128_t)f4 * g1_19;
+    uint128_t r1 = (uint128_t)f0 * g1 + (uint128_t)f1 * g0 + (uint128_t)f2 * g4_19 +
+                   (uint128_t)f3 * g3_19 + (uint128_t)f4 * g2_19;
+    uint128_t r2 = (uint128_t)f0 * g2 + (uint128_t)f1 * g1 + (uint128_t)f2 * g0 +
+                   (uint128_t)f3 * g4_19 + (uint128_t)f4 * g3_19;
+    uint128_t r3 = (uint128_t)f0 * g3 + (uint128_t)f1 * g2 + (uint128_t)f2 * g1 +
+                   (uint128_t)f3 * g0 + (uint128_t)f4 * g4_19;
+    uint128_t r4 = (uint128_t)f0 * g4 + (uint128_t)f1 * g3 + (uint128_t)f2 * g2 +
+                   (uint128_t)f3 * g1 + (uint128_t)f4 * g0;
+    fe_reduce_wide(h, r0, r1, r2, r3, r4);
+}
+
+void fe_sq(Fe* h, const Fe* f) {
+    uint64_t f0 = f->v[0], f1 = f->v[1], f2 = f->v[2], f3 = f->v[3], f4 = f->v[4];
+    uint64_t f0_2 = f0 * 2, f1_2 = f1 * 2;
+    uint64_t f1_38 = f1 * 38, f2_38 = f2 * 38, f3_38 = f3 * 38, f3_19 = f3 * 19, f4_19 = f4 * 19;
+
+    uint128_t r0 = (uint128_t)f0 * f0 + (uint128_t)f1_38 * f4 + (uint128_t)f2_38 * f3;
+    uint128_t r1 = (uint128_t)f0_2 * f1 + (uint128_t)f2_38 * f4 + (uint128_t)f3_19 * f3;
+    uint128_t r2 = (uint128_t)f0_2 * f2 + (uint128_t)f1 * f1 + (uint128_t)f3_38 * f4;
+    uint128_t r3 = (uint128_t)f0_2 * f3 + (uint128_t)f1_2 * f2 + (uint128_t)f4_19 * f4;
+    uint128_t r4 = (uint128_t)f0_2 * f4 + (uint128_t)f1_2 * f3 + (uint128_t)f2 * f2;
+    fe_reduce_wide(h, r0, r1, r2, r3, r4);
+}
+
+void fe_sq_times(Fe* h, const Fe* f, int n) {
+    fe_sq(h, f);
+    while (--n > 0) {
+        fe_sq(h, h);
+    }
+}
+
+// Canonical little-endian encoding, fully reduced below p
+void fe_to_bytes(uint8_t out[32], const Fe* f) {
+    Fe t = *f;
+    fe_carry(&t);
+    fe_carry(&t);
+
+    // q is 1 exactly when t >= p
+    uint64_t q = (t.v[0] + 19) >> 51;
+    q = (t.v[1] + q) >> 51;
+    q = (t.v[2] + q) >> 51;
+    q = (t.v[3] + q) >> 51;
+    q = (t.v[4] + q) >> 51;
+    t.v[0] += 19 * q;
+    t.v[1] += t.v[0] >> 51; t.v[0] &= FE_MASK;
+    t.v[2] += t.v[1] >> 51; t.v[1] &= FE_MASK;
+    t.v[3] += t.v[2] >> 51; t.v[2] &= FE_MASK;
+    t.v[4] += t.v[3] >> 51; t.v[3] &= FE_MASK;
+    t.v[4] &= FE_MASK;
+
+    put_u64_le(out, t.v[0] | (t.v[1] << 51));
+    put_u64_le(out + 8, (t.v[1] >> 13) | (t.v[2] << 38));
+    put_u64_le(out + 16, (t.v[2] >> 26) | (t.v[3] << 25));
+    put_u64_le(out + 24, (t.v[3] >> 39) | (t.v[4] << 12));
+}
+
+// Ignores the top bit, which encodings of points use for the sign of x
+void fe_from_bytes(Fe* h, const uint8_t in[32]) {
+    uint64_t w0 = get_u64_le(in), w1 = get_u64_le(in + 8);
+    uint64_t w2 = get_u64_le(in + 16), w3 = get_u64_le(in + 24);
+    h->v[0] = w0 & FE_MASK;
+    h->v[1] = ((w0 >> 51) | (w1 << 13)) & FE_MASK;
+    h->v[2] = ((w1 >> 38) | (w2 << 26)) & FE_MASK;
+    h->v[3] = ((w2 >> 25) | (w3 << 39)) & FE_MASK;
+    h->v[4] = (w3 >> 12) & FE_MASK;
+}
+
+bool fe_is_zero(const Fe* f) {
+    uint8_t bytes[32];
+    fe_to_bytes(bytes, f);
+    uint8_t bits = 0;
+    for (int i = 0; i < 32; i++) {
+        bits |= bytes[i];
+    }
+    return bits == 0;
+}
+
+bool fe_equal(const Fe* f, const Fe* g) {
+    Fe diff;
+    fe_sub(&diff, f, g);
+    return fe_is_zero(&diff);
+}
+
+bool fe_is_negative(const Fe* f) {
+    uint8_t bytes[32];
+    fe_to_bytes(bytes, f);
+    return bytes[0] & 1;
+}
+
+// z^(2^250 - 1), and z^11 on the way, shared by inversion and square roots
+void fe_pow2_250_1(Fe* out, Fe* z11, const Fe* z) {
+    Fe z2, z9, t0, t1;
+    fe_sq(&z2, z);
+    fe_sq_times(&t0, &z2, 2);
+    fe_mul(&z9, &t0, z);
+    fe_mul(z11, &z9, &z2);
+    fe_sq(&t0, z11);
+    fe_mul(&t0, &t0, &z9);            // 2^5 - 1
+    fe_sq_times(&t1, &t0, 5);
+    fe_mul(&t0, &t1, &t0);            // 2^10 - 1
+    fe_sq_times(&t1, &t0, 10);
+    fe_mul(&t1, &t1, &t0);            // 2^20 - 1
+    Fe t2;
+    fe_sq_times(&t2, &t1, 20);
+    fe_mul(&t1, &t2, &t1);            // 2^40 - 1
+    fe_sq_times(&t1, &t1, 10);
+    fe_mul(&t0, &t1, &t0);            // 2^50 - 1
+    fe_sq_times(&t1, &t0, 50);
+    fe_mul(&t1, &t1, &t0);            // 2^100 - 1
+    fe_sq_times(&t2, &t1, 100);
+    fe_mul(&t1, &t2, &t1);            // 2^200 - 1
+    fe_sq_times(&t1, &t1, 50);
+    fe_mul(out, &t1, &t0);            // 2^250 - 1
+}
+
+// z^(p - 2) = z^(2^255 - 21)
+void fe_invert(Fe* out, const Fe* z) {
+    Fe t, z11;
+    fe_pow2_250_1(&t, &z11, z);
+    fe_sq_times(&t, &t, 5);
+    fe_mul(out, &t, &z11);
+}
+
+// z^((p - 5) / 8) = z^(2^252 - 3)
+void fe_pow22523(Fe* out, const Fe* z) {
+    Fe t, z11;
+    fe_pow2_250_1(&t, &z11, z);
+    fe_sq_times(&t, &t, 2);
+    fe_mul(out, &t, z);
+}
+
+void ge_identity(GePoint* p) {
+    memset(p, 0, sizeof(*p));
+    p->Y.v[0] = 1;
+    p->Z.v[0] = 1;
+}
+
+// Unified addition (add-2008-hwcd-3), complete on this curve so it also doubles and adds the identity
+void ge_add(GePoint* r, const GePoint* p, const GePoint* q) {
+    Fe a, b, c, d, e, f, g, h, t;
+    fe_sub(&a, &p->Y, &p->X);
+    fe_sub(&t, &q->Y, &q->X);
+    fe_mul(&a, &a, &t);
+    fe_add(&b, &p->Y, &p->X);
+    fe_add(&t, &q->Y, &q->X);
+    fe_mul(&b, &b, &t);
+    fe_mul(&c, &p->T, &q->T);
+    fe_mul(&c, &c, &fe_d2);
+    fe_mul(&d, &p->Z, &q->Z);
+    fe_add(&d, &d, &d);
+    fe_sub(&e, &b, &a);
+    fe_sub(&f, &d, &c);
+    fe_add(&g, &d, &c);
+    fe_add(&h, &b, &a);
+    fe_mul(&r->X, &e, &f);
+    fe_mul(&r->Y, &g, &h);
+    fe_mul(&r->T, &e, &h);
+    fe_mul(&r->Z, &f, &g);
+}
+
+// dbl-2008-hwcd for a = -1, with E, F, G and H negated, which leaves the result unchanged
+void ge_double(GePoint* r, const GePoint* p) {
+    Fe a, b, c, e, f, g, h;
+    fe_sq(&a, &p->X);
+    fe_sq(&b, &p->Y);
+    fe_sq(&c, &p->Z);
+    fe_add(&c, &c, &c);
+    fe_add(&h, &a, &b);
+    fe_add(&e, &p->X, &p->Y);
+    fe_sq(&e, &e);
+    fe_sub(&e, &h, &e);
+    fe_sub(&g, &a, &b);
+    fe_add(&f, &c, &g);
+    fe_mul(&r->X, &e, &f);
+    fe_mul(&r->Y, &g, &h);
+    fe_mul(&r->T, &e, &h);
+    fe_mul(&r->Z, &f, &g);
+}
+
+void ge_encode(uint8_t out[32], const GePoint* p) {
+    Fe z_inv, x, y;
+    fe_invert(&z_inv, &p->Z);
+    fe_mul(&x, &p->X, &z_inv);
+    fe_mul(&y, &p->Y, &z_inv);
+    fe_to_bytes(out, &y);
+    out[31] |= (uint8_t)(fe_is_negative(&x) << 7);
+}
+
+// RFC 8032 5.1.3; false for a non-canonical y or a y with no point on the curve
+bool ge_decode(GePoint* p, const uint8_t in[32]) {
+    uint8_t canonical[32];
+    fe_from_bytes(&p->Y, in);
+    fe_to_bytes(canonical, &p->Y);
+    if (memcmp(canonical, in, 31) != 0 || canonical[31] != (in[31] & 0x7f)) {
+        return false;
+    }
+
+    // x^2 = u / v with u = y^2 - 1, v = d y^2 + 1; candidate x = u v^3 (u v^7)^((p - 5) / 8)
+    Fe one, u, v, v3, t, vxx;
+    memset(&one, 0, sizeof(one));
+    one.v[0] = 1;
+    fe_sq(&u, &p->Y);
+    fe_mul(&v, &u, &fe_d);
+    fe_sub(&u, &u, &one);
+    fe_add(&v, &v, &one);
+    fe_sq(&v3, &v);
+    fe_mul(&v3, &v3, &v);
+    fe_sq(&t, &v3);
+    fe_mul(&t, &t, &v);
+    fe_mul(&t, &t, &u);
+    fe_pow22523(&t, &t);
+    fe_mul(&t, &t, &v3);
+    fe_mul(&p->X, &t, &u);
+
+    fe_sq(&vxx, &p->X);
+    fe_mul(&vxx, &vxx, &v);
+    if (!fe_equal(&vxx, &u)) {
+        fe_add(&t, &vxx, &u);
+        if (!fe_is_zero(&t)) {
+            return false;
+        }
+        fe_mul(&p->X, &p->X, &fe_sqrtm1);
+    }
+
+    bool sign = in[31] >> 7;
+    if (sign && fe_is_zero(&p->X)) {
+        return false;
+    }
+    if (fe_is_negative(&p->X) != sign) {
+        Fe zero;
+        memset(&zero, 0, sizeof(zero));
+        fe_sub(&p->X, &zero, &p->X);
+    }
+    p->Z = one;
+    fe_mul(&p->T, &p->X, &p->Y);
+    return true;
+}
+
+bool ge_is_identity(const GePoint* p) {
+    return fe_is_zero(&p->X) && fe_equal(&p->Y, &p->Z);
+}
+
+// out[0 .. na + nb) = a * b
+void mul_limbs(uint64_t* out, const uint64_t* a, int na, const uint64_t* b, int nb) {
+    memset(out, 0, sizeof(uint64_t) * (size_t)(na + nb));
+    for (int i = 0; i < na; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < nb; j++) {
+            uint128_t t = (uint128_t)a[i] * b[j] + out[i + j] + carry;
+            out[i + j] = (uint64_t)t;
+            carry = (uint64_t)(t >> 64);
+        }
+        out[i + nb] = carry;
+    }
+}
+
+bool limbs_below_order(const uint64_t r[5]) {
+    if (r[4] != 0) return false;
+    for (int i = 3; i >= 0; i--) {
+        if (r[i] != sc_order.limb[i]) return r[i] < sc_order.limb[i];
+    }
+    return false;
+}
+
+// r -= b over five limbs, modulo 2^320
+void sub_limbs(uint64_t r[5], const uint64_t b[5]) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < 5; i++) {
+        uint128_t t = (uint128_t)r[i] - b[i] - borrow;
+        r[i] = (uint64_t)t;
+        borrow = (uint64_t)(t >> 64) & 1;
+    }
+}
+
+// Barrett reduction of a 512-bit integer (HAC 14.42 with base 2^64, k = 4)
+void sc_reduce_limbs(Scalar* out, const uint64_t x[8]) {
+    uint64_t q[10], qm[9];
+    mul_limbs(q, x + 3, 5, sc_barrett_mu, 5);
+    mul_limbs(qm, q + 5, 5, sc_order.limb, 4);
+
+    uint64_t r[5];
+    memcpy(r, x, sizeof(r));
+    sub_limbs(r, qm);
+    uint64_t order[5] = {sc_order.limb[0], sc_order.limb[1], sc_order.limb[2], sc_order.limb[3], 0};
+    while (!limbs_below_order(r)) {
+        sub_limbs(r, order);
+    }
+    memcpy(out->limb, r, sizeof(out->limb));
+}
+
+// A 64-byte little-endian integer, such as a SHA-512 digest, modulo L
+void sc_reduce_wide(Scalar* out, const uint8_t in[64]) {
+    uint64_t x[8];
+    for (int i = 0; i < 8; i++) {
+        x[i] = get_u64_le(in + i * 8);
+    }
+    sc_reduce_limbs(out, x);
+}
+
+// False unless the encoding is canonical, i.e. below L
+bool sc_from_bytes(Scalar* out, const uint8_t in[32]) {
+    uint64_t r[5] = {0};
+    for (int i = 0; i < 4; i++) {
+        r[i] = get_u64_le(in + i * 8);
+    }
+    memcpy(out->limb, r, sizeof(out->limb));
+    return limbs_below_order(r);
+}
+
+void sc_to_bytes(uint8_t out[32], const Scalar* s) {
+    for (int i = 0; i < 4; i++) {
+        put_u64_le(out + i * 8, s->limb[i]);
+    }
+}
+
+// a * b + c mod L
+void sc_muladd(Scalar* out, const Scalar* a, const Scalar* b, const Scalar* c) {
+    uint64_t x[8];
+    mul_limbs(x, a->limb, 4, b->limb, 4);
+    uint64_t carry = 0;
+    for (int i = 0; i < 8; i++) {
+        uint128_t t = (uint128_t)x[i] + (i < 4 ? c->limb[i] : 0) + carry;
+        x[i] = (uint64_t)t;
+        carry = (uint64_t)(t >> 64);
+    }
+    sc_reduce_limbs(out, x);
+}
+
+void sc_negate(Scalar* out, const Scalar* a) {
+    uint64_t r[5] = {sc_order.limb[0], sc_order.limb[1], sc_order.limb[2], sc_order.limb[3], 0};
+    uint64_t b[5] = {a->limb[0], a->limb[1], a->limb[2], a->limb[3], 0};
+    if ((b[0] | b[1] | b[2] | b[3]) == 0) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    sub_limbs(r, b);
+    memcpy(out->limb, r, sizeof(out->limb));
+}
+
+// Bits [bit, bit + width) of a scalar
+unsigned scalar_window(const Scalar* s, int bit, int width) {
+    int limb = bit / 64, shift = bit % 64;
+    if (limb >= 4) return 0;
+    uint64_t bits = s->limb[limb] >> shift;
+    if (shift + width > 64 && limb + 1 < 4) {
+        bits |= s->limb[limb + 1] << (64 - shift);
+    }
+    return (unsigned)(bits & ((1ULL << width) - 1));
+}
+
+// d * 16^w * B for every 4-bit window w, so a base point multiple costs 64 additions
+GePoint base_table[64][16];
+pthread_once_t base_table_once = PTHREAD_ONCE_INIT;
+
+void build_base_table() {
+    GePoint p = ge_base;
+    for (int w = 0; w < 64; w++) {
+        ge_identity(&base_table[w][0]);
+        for (int d = 1; d < 16; d++) {
+            ge_add(&base_table[w][d], &base_table[w][d - 1], &p);
+        }
+        ge_double(&p, &base_table[w][8]);
+    }
+}
+
+// [s]B. Variable time, like everything here: signing keys in this simulation are derived from
+// public names anyway, so there is no secret for timing to leak.
+void ge_scalar_mul_base(GePoint* r, const Scalar* s) {
+    pthread_once(&base_table_once, build_base_table);
+    ge_identity(r);
+    for (int w = 0; w < 64; w++) {
+        unsigned d = scalar_window(s, w * 4, 4);
+        if (d) ge_add(r, r, &base_table[w][d]);
+    }
+}
+
+// Straus: one shared chain of doublings, adding a precomputed multiple of each point per 4-bit window
+void multi_scalar_mul_straus(GePoint* r, const GePoint* points, const Scalar* scalars, size_t count) {
+    GePoint (*tables)[16] = (GePoint(*)[16])malloc(sizeof(*tables) * count);
+    for (size_t i = 0; i < count; i++) {
+        tables[i][1] = points[i];
+        for (int d = 2; d < 16; d++) {
+            ge_add(&tables[i][d], &tables[i][d - 1], &points[i]);
+        }
+    }
+
+    ge_identity(r);
+    bool started = false;
+    for (int w = 63; w >= 0; w--) {
+        if (started) {
+            for (int k = 0; k < 4; k++) ge_double(r, r);
+        }
+        for (size_t i = 0; i < count; i++) {
+            unsigned d = scalar_window(&scalars[i], w * 4, 4);
+            if (d) {
+                ge_add(r, r, &tables[i][d]);
+                started = true;
+            }
+        }
+    }
+    free(tables);
+}
+
+// Pippenger: per window, drop each point into the bucket of its digit, then weight the buckets
+// with running sums. Cheaper than Straus once there are hundreds of points.
+void multi_scalar_mul_pippenger(GePoint* r, const GePoint* points, const Scalar* scalars, size_t count) {
+    // Window width minimizing (253 / c) * (count + 2^(c + 1)) additions
+    int c = 4;
+    double best = 0;
+    for (int width = 4; width <= 16; width++) {
+        double cost = (253.0 / width) * ((double)count + (double)(2u << width));
+        if (width == 4 || cost < best) {
+            best = cost;
+            c = width;
+        }
+    }
+    size_t bucket_count = ((size_t)1 << c) - 1;
+    GePoint* buckets = (GePoint*)malloc(sizeof(GePoint) * bucket_count);
+    bool* used = (bool*)malloc(bucket_count);
+
+    ge_identity(r);
+    bool started = false;
+    for (int w = (253 + c - 1) / c - 1; w >= 0; w--) {
+        if (started) {
+            for (int k = 0; k < c; k++) ge_double(r, r);
+        }
+        memset(used, 0, bucket_count);
+        for (size_t i = 0; i < count; i++) {
+            unsigned d = scalar_window(&scalars[i], w * c, c);
+            if (d == 0) continue;
+            if (used[d - 1]) {
+                ge_add(&buckets[d - 1], &buckets[d - 1], &points[i]);
+            } else {
+                buckets[d - 1] = points[i];
+                used[d - 1] = true;
+            }
+        }
+
+        // sum over d of d * bucket[d], as the sum of the running totals from the top bucket down
+        GePoint running, sum;
+        bool any = false;
+        for (size_t b = bucket_count; b-- > 0;) {
+            if (used[b] && any) {
+                ge_add(&running, &running, &buckets[b]);
+            } else if (used[b]) {
+                running = buckets[b];
+                ge_identity(&sum);
+                any = true;
+            }
+            if (any) ge_add(&sum, &sum, &running);
+        }
+        if (any) {
+            ge_add(r, r, &sum);
+            started = true;
+        }
+    }
+    free(buckets);
+    free(used);
+}
+
+// sum of [scalars[i]] points[i]
+void multi_scalar_mul(GePoint* r, const GePoint* points, const Scalar* scalars, size_t count) {
+    if (count <= STRAUS_MAX_POINTS) {
+        multi_scalar_mul_straus(r, points, scalars, count);
+    } else {
+        multi_scalar_mul_pippenger(r, points, scalars, count);
+    }
+}
+
+// Secret scalar a and nonce prefix of a seed (RFC 8032 5.1.5)
+void ed25519_expand(const uint8_t seed[ED25519_SEED_SIZE], Scalar* a, uint8_t prefix[32]) {
+    uint8_t h[64];
+    sha512(seed, ED25519_SEED_SIZE, h);
+    h[0] &= 248;
+    h[31] &= 127;
+    h[31] |= 64;
+    memcpy(prefix, h + 32, 32);
+    memset(h + 32, 0, 32);
+    sc_reduce_wide(a, h);
+}
+
+void ed25519_public_key(const uint8_t seed[ED25519_SEED_SIZE], uint8_t public_key[ADDRESS_SIZE]) {
+    Scalar a;
+    uint8_t prefix[32];
+    GePoint A;
+    ed25519_expand(seed, &a, prefix);
+    ge_scalar_mul_base(&A, &a);
+    ge_encode(public_key, &A);
+}
+
+// k = SHA-512(R || A || M) mod L
+void ed25519_challenge(Scalar* k, const uint8_t* signature, const uint8_t* public_key,
+                       const uint8_t* message, size_t message_len) {
+    Sha512Ctx ctx;
+    uint8_t digest[64];
+    sha512_init(&ctx);
+    sha512_update(&ctx, signature, 32);
+    sha512_update(&ctx, public_key, ADDRESS_SIZE);
+    sha512_update(&ctx, message, message_len);
+    sha512_final(&ctx, digest);
+    sc_reduce_wide(k, digest);
+}
+
+void ed25519_sign(const uint8_t seed[ED25519_SEED_SIZE], const uint8_t public_key[ADDRESS_SIZE],
+                  const uint8_t* message, size_t message_len, uint8_t signature[SIGNATURE_SIZE]) {
+    Scalar a, r, k, s;
+    uint8_t prefix[32];
+    uint8_t digest[64];
+    ed25519_expand(seed, &a, prefix);
+
+    Sha512Ctx ctx;
+    sha512_init(&ctx);
+    sha512_update(&ctx, prefix, sizeof(prefix));
+    sha512_update(&ctx, message, message_len);
+    sha512_final(&ctx, digest);
+    sc_reduce_wide(&r, digest);
+
+    GePoint R;
+    ge_scalar_mul_base(&R, &r);
+    ge_encode(signature, &R);
+    ed25519_challenge(&k, signature, public_key, message, message_len);
+    sc_muladd(&s, &k, &a, &r);
+    sc_to_bytes(signature + 32, &s);
+}
+
+// True when every signature in the batch is valid under the cofactored equation
+//     [8][S]B = [8]R + [8][k]A
+// The batch is checked as one multi-scalar multiplication of a random linear combination,
+//     [8]([-sum z_i S_i]B + sum [z_i]R_i + sum [z_i k_i]A_i) = identity,
+// with 128-bit weights z_i hashed from the whole batch: reproducible from run to run, yet fixed
+// only after every signature is, so a bad signature gets through with probability about 2^-128.
+// A failed batch does not say which signature is bad; callers check them one by one for that.
+bool ed25519_verify_batch(const SignatureCheck* checks, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    size_t point_count = count * 2 + 1;
+    GePoint* points = (GePoint*)malloc(sizeof(GePoint) * point_count);
+    Scalar* scalars = (Scalar*)malloc(sizeof(Scalar) * point_count);
+    Sha512Ctx transcript;
+    sha512_init(&transcript);
+
+    // Points 2i + 1 and 2i + 2 are R_i and A_i; their scalars hold S_i and k_i until the weights exist
+    bool valid = true;
+    for (size_t i = 0; i < count && valid; i++) {
+        const SignatureCheck* check = &checks[i];
+        uint8_t k_bytes[32];
+        if (check->key != NULL) {
+            points[2 * i + 2] = *check->key;
+        }
+        valid = ge_decode(&points[2 * i + 1], check->signature) &&
+                (check->key != NULL || ge_decode(&points[2 * i + 2], check->public_key)) &&
+                sc_from_bytes(&scalars[2 * i + 1], check->signature + 32);
+        if (!valid) break;
+        ed25519_challenge(&scalars[2 * i + 2], check->signature, check->public_key,
+                          check->message, check->message_len);
+        sc_to_bytes(k_bytes, &scalars[2 * i + 2]);
+        sha512_update(&transcript, check->signature, SIGNATURE_SIZE);
+        sha512_update(&transcript, check->public_key, ADDRESS_SIZE);
+        sha512_update(&transcript, k_bytes, sizeof(k_bytes));
+    }
+
+    if (valid) {
+        uint8_t seed[64 + 8];
+        uint8_t weights[64];
+        Scalar s_sum, zero;
+        memset(&s_sum, 0, sizeof(s_sum));
+        memset(&zero, 0, sizeof(zero));
+        sha512_final(&transcript, seed);
+        for (size_t i = 0; i < count; i++) {
+            // Four weights per digest; a lone signature needs no weight at all
+            Scalar z;
+            memset(&z, 0, sizeof(z));
+            if (count == 1) {
+                z.limb[0] = 1;
+            } else {
+                if (i % 4 == 0) {
+                    put_u64_le(seed + 64, i / 4);
+                    sha512(seed, sizeof(seed), weights);
+                }
+                z.limb[0] = get_u64_le(weights + (i % 4) * 16);
+                z.limb[1] = get_u64_le(weights + (i % 4) * 16 + 8);
+            }
+            sc_muladd(&s_sum, &z, &scalars[2 * i + 1], &s_sum);
+            sc_muladd(&scalars[2 * i + 2], &z, &scalars[2 * i + 2], &zero);
+            scalars[2 * i + 1] = z;
+        }
+        points[0] = ge_base;
+        sc_negate(&scalars[0], &s_sum);
+
+        GePoint sum;
+        multi_scalar_mul(&sum, points, scalars, point_count);
+        for (int k = 0; k < 3; k++) ge_double(&sum, &sum);
+        valid = ge_is_identity(&sum);
+    }
+
+    free(points);
+    free(scalars);
+    return valid;
+}
+
+bool ed25519_verify(const uint8_t public_key[ADDRESS_SIZE], const uint8_t* message, size_t message_len,
+                    const uint8_t signature[SIGNATURE_SIZE]) {
+    SignatureCheck check = {public_key, NULL, message, message_len, signature};
+    return ed25519_verify_batch(&check, 1);
+}
+
+// Overflow-checked arithmetic on amounts; false when the result does not fit
+bool amount_add(Amount a, Amount b, Amount* out) {
+    return !__builtin_add_overflow(a, b, out);
+}
+
+bool amount_sub(Amount a, Amount b, Amount* out) {
+    return !__builtin_sub_overflow(a, b, out);
+}
+
+// Coins with two decimals, or as many more as the base units need: 60.00, 0.10, 0.00000001
+void format_amount(Amount amount, char out[AMOUNT_TEXT_SIZE]) {
+    uint64_t magnitude = amount < 0 ? -(uint64_t)amount : (uint64_t)amount;
+    uint64_t fraction = magnitude % COIN;
+    int decimals = 8;   // COIN is 10^8 base units
+    while (decimals > 2 && fraction % 10 == 0) {
+        fraction /= 10;
+        decimals--;
+    }
+    snprintf(out, AMOUNT_TEXT_SIZE, "%s%llu.%0*llu", amount < 0 ? "-" : "",
+             (unsigned long long)(magnitude / COIN), decimals, (unsigned long long)fraction);
+}
+
+// The bytes the sender signs: sender | receiver | amount i64 | fee i64 | nonce | timestamp
+void encode_transaction_body(const Transaction* tx, uint8_t out[TX_BODY_SIZE]) {
+    memcpy(out, tx->sender.bytes, ADDRESS_SIZE);
+    memcpy(out + ADDRESS_SIZE, tx->receiver.bytes, ADDRESS_SIZE);
+    put_u64_le(out + ADDRESS_SIZE * 2, (uint64_t)tx->amount);
+    put_u64_le(out + ADDRESS_SIZE * 2 + 8, (uint64_t)tx->fee);
+    put_u64_le(out + ADDRESS_SIZE * 2 + 16, tx->nonce);
+    put_u64_le(out + ADDRESS_SIZE * 2 + 24, (uint64_t)(int64_t)tx->timestamp);
+}
+
+// Fixed 160-byte layout: the signed body followed by the signature
+void encode_transaction_into(const Transaction* tx, uint8_t out[TX_ENCODED_SIZE]) {
+    encode_transaction_body(tx, out);
+    memcpy(out + TX_BODY_SIZE, tx->signature, SIGNATURE_SIZE);
+}
+
+void decode_transaction(const uint8_t in[TX_ENCODED_SIZE], Transaction* tx) {
+    memcpy(tx->sender.bytes, in, ADDRESS_SIZE);
+    memcpy(tx->receiver.bytes, in + ADDRESS_SIZE, ADDRESS_SIZE);
+    tx->amount = (Amount)get_u64_le(in + ADDRESS_SIZE * 2);
+    tx->fee = (Amount)get_u64_le(in + ADDRESS_SIZE * 2 + 8);
+    tx->nonce = get_u64_le(in + ADDRESS_SIZE * 2 + 16);
+    tx->timestamp = (time_t)(int64_t)get_u64_le(in + ADDRESS_SIZE * 2 + 24);
+    memcpy(tx->signature, in + TX_BODY_SIZE, SIGNATURE_SIZE);
+}
+
+void encode_transaction(const Transaction* tx, ByteBuffer* buf) {
+    encode_transaction_into(tx, byte_buffer_extend(buf, TX_ENCODED_SIZE));
+}
+
+// Leaves and inner nodes use different prefixes so an inner node can never pass as a leaf
+void merkle_leaf_hash(const Transaction* tx, uint8_t out[HASH_SIZE]) {
+    uint8_t leaf[1 + TX_ENCODED_SIZE];
+    leaf[0] = 0x00;
+    encode_transaction_into(tx, leaf + 1);
+    sha256(leaf, sizeof(leaf), out);
+}
+
+void merkle_node_hash(const uint8_t left[HASH_SIZE], const uint8_t right[HASH_SIZE], uint8_t out[HASH_SIZE]) {
+    uint8_t prefix = 0x01;
+    Sha256Ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, HASH_SIZE);
+    sha256_update(&ctx, right, HASH_SIZE);
+    sha256_final(&ctx, out);
+}
+
+void merkle_init(MerkleTree* tree) {
+    tree->nodes = NULL;
+    tree->leaf_count = 0;
+    tree->capacity = 0;
+}
+
+void merkle_free(MerkleTree* tree) {
+    free(tree->nodes);
+    merkle_init(tree);
+}
+
+// Recomputes every ancestor of leaf `index`
+void merkle_update_path(MerkleTree* tree, int index) {
+    int offset = 0;
+    int width = tree->leaf_count;
+    while (width > 1) {
+        int parent_width = (width + 1) / 2;
+        int left = index & ~1;
+        uint8_t* parent = tree->nodes[offset + width + index / 2];
+        if (left + 1 < width) {
+            merkle_node_hash(tree->nodes[offset + left], tree->nodes[offset + left + 1], parent);
+        } else {
+            memcpy(parent, tree->nodes[offset + left], HASH_SIZE);
+        }
+        offset += width;
+        width = parent_width;
+        index /= 2;
+    }
+}
+
+// Sizes the tree for `count` leaves; the leaf hashes are left to the caller
+void merkle_reset(MerkleTree* tree, int count) {
+    int total = 0;
+    for (int width = count; width > 0; width = width > 1 ? (width + 1) / 2 : 0) {
+        total += width;
+    }
+    if (total > tree->capacity) {
+        tree->nodes = (uint8_t (*)[HASH_SIZE])realloc(tree->nodes, (size_t)total * HASH_SIZE);
+        tree->capacity = total;
+    }
+    tree->leaf_count = count;
+}
+
+// Hashes every level above the leaves
+void merkle_build_parents(MerkleTree* tree) {
+    int offset = 0;
+    for (int width = tree->leaf_count; width > 1; width = (width + 1) / 2) {
+        for (int i = 0; i < width; i += 2) {
+            uint8_t* parent = tree->nodes[offset + width + i / 2];
+            if (i + 1 < width) {
+                merkle_node_hash(tree->nodes[offset + i], tree->nodes[offset + i + 1], parent);
+            } else {
+                memcpy(parent, tree->nodes[offset + i], HASH_SIZE);
+            }
+        }
+        offset += width;
+    }
+}
+
+void merkle_build(MerkleTree* tree, const Transaction* txs, int count) {
+    merkle_reset(tree, count);
+    for (int i = 0; i < count; i++) {
+        merkle_leaf_hash(&txs[i], tree->nodes[i]);
+    }
+    merkle_build_parents(tree);
+}
+
+void merkle_root(const MerkleTree* tree, uint8_t out[HASH_SIZE]) {
+    if (tree->leaf_count == 0) {
+        memset(out, 0, HASH_SIZE);
+        return;
+    }
+    int offset = 0;
+    for (int width = tree->leaf_count; width > 1; width = (width + 1) / 2) {
+        offset += width;
+    }
+    memcpy(out, tree->nodes[offset], HASH_SIZE);
+}
+
+// Replaces one leaf and rehashes only its path, O(log n) instead of a full rebuild
+void merkle_update_leaf(MerkleTree* tree, int index, const Transaction* tx) {
+    merkle_leaf_hash(tx, tree->nodes[index]);
+    merkle_update_path(tree, index);
+}
+
+bool merkle_proof(const MerkleTree* tree, int index, MerkleProof* proof) {
+    if (index < 0 || index >= tree->leaf_count) return false;
+
+    proof->leaf_index = index;
+    proof->leaf_count = tree->leaf_count;
+    proof->length = 0;
+
+    int offset = 0;
+    for (int width = tree->leaf_count; width > 1; width = (width + 1) / 2) {
+        int sibling = index ^ 1;
+        if (sibling < width) {
+            memcpy(proof->siblings[proof->length++], tree->nodes[offset + sibling], HASH_SIZE);
+        }
+        offset += width;
+        index /= 2;
+    }
+    return true;
+}
+
+// Light-client check: only the leaf, the proof and the header's root are needed
+bool merkle_verify(const uint8_t leaf[HASH_SIZE], const MerkleProof* proof, const uint8_t root[HASH_SIZE]) {
+    uint8_t hash[HASH_SIZE];
+    memcpy(hash, leaf, HASH_SIZE);
+
+    int index = proof->leaf_index;
+    int used = 0;
+    for (int width = proof->leaf_count; width > 1; width = (width + 1) / 2) {
+        int sibling = index ^ 1;
+        if (sibling < width) {
+            if (used >= proof->length) return false;
+            if (index & 1) {
+                merkle_node_hash(proof->siblings[used], hash, hash);
+            } else {
+                merkle_node_hash(hash, proof->siblings[used], hash);
+            }
+            used++;
+        }
+        index /= 2;
+    }
+    return used == proof->length && memcmp(hash, root, HASH_SIZE) == 0;
+}
+
+// Builds the tree over the block's transactions and stores its root in the header
+void compute_merkle_root(Block* block, MerkleTree* tree) {
+    merkle_build(tree, block->transactions, block->tx_count);
+    merkle_root(tree, block->merkle_root);
+}
+
+// Fixed 88-byte header:
+//   0 index u32 | 4 timestamp u64 | 12 previous_hash | 44 merkle_root | 76 difficulty_bits u32 | 80 nonce u64
+void encode_block_header(const Block* block, uint8_t out[BLOCK_HEADER_SIZE]) {
+    put_u32_le(out, (uint32_t)block->index);
+    put_u64_le(out + 4, (uint64_t)(int64_t)block->timestamp);
+    memcpy(out + 12, block->previous_hash, HASH_SIZE);
+    memcpy(out + 44, block->merkle_root, HASH_SIZE);
+    put_u32_le(out + 76, block->difficulty_bits);
+    put_u64_le(out + HEADER_NONCE_OFFSET, block->nonce);
+}
+
+void compute_block_hash(const Block* block, uint8_t out[HASH_SIZE]) {
+    uint8_t header[BLOCK_HEADER_SIZE];
+    encode_block_header(block, header);
+    sha256(header, BLOCK_HEADER_SIZE, out);
+}
+
+// The first 64 header bytes never change while mining, so their compression is done once.
+// Each attempt patches the nonce into the pre-padded final block and compresses only that.
+typedef struct {
+    uint32_t midstate[8];
+    uint8_t tail[64];
+} HeaderHasher;
+
+void header_hasher_init(HeaderHasher* hasher, const uint8_t header[BLOCK_HEADER_SIZE]) {
+    memcpy(hasher->midstate, sha256_initial_state, sizeof(hasher->midstate));
+    sha256_compress(hasher->midstate, header, 1);
+
+    memset(hasher->tail, 0, sizeof(hasher->tail));
+    memcpy(hasher->tail, header + 64, BLOCK_HEADER_SIZE - 64);
+    hasher->tail[BLOCK_HEADER_SIZE - 64] = 0x80;
+    uint64_t bit_length = (uint64_t)BLOCK_HEADER_SIZE * 8;
+    for (int i = 0; i < 8; i++) {
+        hasher->tail[63 - i] = (uint8_t)(bit_length >> (i * 8));
+    }
+}
+
+void header_hasher_hash(HeaderHasher* hasher, uint64_t nonce, uint8_t out[HASH_SIZE]) {
+    uint32_t state[8];
+    memcpy(state, hasher->midstate, sizeof(state));
+    put_u64_le(hasher->tail + (HEADER_NONCE_OFFSET - 64), nonce);
+    sha256_compress(state, hasher->tail, 1);
+
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (uint8_t)(state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+typedef struct {
+    uint8_t header[BLOCK_HEADER_SIZE];
+    int difficulty_bits;
+    uint64_t start_nonce;
+    atomic_uint_fast64_t best;   // Smallest offset from start_nonce found so far
+    atomic_uint_fast64_t hashes;
+} PowSearch;
+
+#define POW_CHECK_INTERVAL 1024
+
+// Worker `w` of `n` tries start + w, start + w + n, ... until it passes the best offset any
+// worker has found, so the result is the first solution after start_nonce however many
+// workers share the search
+void pow_search_task(void* arg, int worker, int workers) {
+    PowSearch* search = (PowSearch*)arg;
+    uint64_t offset = (uint64_t)worker;
+    uint64_t attempts = 0;
+    uint8_t hash[HASH_SIZE];
+    HeaderHasher hasher;   // Per worker, the tail block is patched in place
+    header_hasher_init(&hasher, search->header);
+
+    while (true) {
+        if (attempts % POW_CHECK_INTERVAL == 0 &&
+            offset > atomic_load_explicit(&search->best, memory_order_relaxed)) {
+            break;
+        }
+
+        header_hasher_hash(&hasher, search->start_nonce + offset, hash);
+        attempts++;
+
+        if (hash_meets_difficulty(hash, search->difficulty_bits)) {
+            uint_fast64_t best = atomic_load(&search->best);
+            while (offset < best && !atomic_compare_exchange_weak(&search->best, &best, offset)) {
+            }
+            break;
+        }
+        offset += (uint64_t)workers;
+    }
+
+    atomic_fetch_add(&search->hashes, attempts);
+}
+
+// Splits the nonce space across the mining pool, starting from `start_nonce`
+void mine_nonce(Node* node, Block* block, uint64_t start_nonce) {
+    PowSearch search;
+    encode_block_header(block, search.header);
+    search.difficulty_bits = (int)block->difficulty_bits;
+    search.start_nonce = start_nonce;
+    atomic_init(&search.best, UINT64_MAX);
+    atomic_init(&search.hashes, 0);
+
+    double started = monotonic_seconds();
+    worker_pool_run(&mining_pool, pow_search_task, &search);
+    double elapsed = monotonic_seconds() - started;
+
+    node->nonce_searches++;
+    pthread_mutex_lock(&mining_stats_lock);
+    mining_searches++;
+    mining_hashes += atomic_load(&search.hashes);
+    mining_seconds += elapsed;
+    pthread_mutex_unlock(&mining_stats_lock);
+
+    block->nonce = start_nonce + atomic_load(&search.best);
+    compute_block_hash(block, block->hash);
+}
+
+void arena_init(Arena* arena) {
+    arena->chunks = NULL;
+    arena->allocations = 0;
+    arena->bytes = 0;
+    arena->reserved = 0;
+    arena->chunk_count = 0;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t aligned = (size + 15) & ~(size_t)15;
+    ArenaChunk* chunk = arena->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < aligned) {
+        size_t capacity = chunk == NULL ? ARENA_FIRST_CHUNK : chunk->size * 2;
+        if (capacity > ARENA_CHUNK_SIZE) capacity = ARENA_CHUNK_SIZE;
+        if (capacity < aligned) capacity = aligned;
+        chunk = (ArenaChunk*)malloc(sizeof(ArenaChunk) + capacity);
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = capacity;
+        arena->chunks = chunk;
+        arena->reserved += capacity;
+        arena->chunk_count++;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += aligned;
+    arena->allocations++;
+    arena->bytes += size;
+    return ptr;
+}
+
+// Frees everything allocated from the arena, one free per chunk
+void arena_release(Arena* arena) {
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(arena);
+}
+
+size_t block_size(int tx_count) {
+    return sizeof(Block) + sizeof(Transaction) * (size_t)tx_count;
+}
+
+// The caller holds the only reference until it publishes the block to a chain.
+// Memory comes from the owner's arena and outlives the last reference until the arena goes.
+Block* block_alloc(Arena* arena, int tx_count) {
+    size_t size = block_size(tx_count);
+    Block* block = (Block*)arena_alloc(arena, size);
+    atomic_init(&block->refs, 1);
+    atomic_fetch_add(&block_store.blocks, 1);
+    atomic_fetch_add(&block_store.bytes, size);
+    return block;
+}
+
+// Blocks are immutable once shared; only the reference count changes
+const Block* block_retain(const Block* block) {
+    atomic_fetch_add_explicit(&((Block*)block)->refs, 1, memory_order_relaxed);
+    return block;
+}
+
+void block_release(const Block* block) {
+    if (atomic_fetch_sub_explicit(&((Block*)block)->refs, 1, memory_order_acq_rel) == 1) {
+        atomic_fetch_sub(&block_store.blocks, 1);
+        atomic_fetch_sub(&block_store.bytes, block_size(block->tx_count));
+    }
+}
+
+Block* create_genesis_block(Arena* arena) {
+    Block* block = block_alloc(arena, 0);
+    block->index = 0;
+    block->timestamp = sim_time();
+    memset(block->previous_hash, 0, HASH_SIZE);
+    block->difficulty_bits = 0;
+    block->nonce = 0;
+    block->tx_count = 0;
+
+    MerkleTree tree;
+    merkle_init(&tree);
+    compute_merkle_root(block, &tree);
+    merkle_free(&tree);
+    compute_block_hash(block, block->hash);
+
+    return block;
+}
+
+// Fills the node's reusable candidate; it still needs transactions and a nonce from mine_nonce
+Block* create_block(Node* node, int index, const uint8_t previous_hash[HASH_SIZE], int tx_count) {
+    size_t size = block_size(tx_count);
+    if (node->candidate_capacity < size) {
+        free(node->candidate);
+        node->candidate = (Block*)malloc(size);
+        node->candidate_capacity = size;
+    }
+
+    Block* block = node->candidate;
+    block->index = index;
+    block->timestamp = sim_time();
+    memcpy(block->previous_hash, previous_hash, HASH_SIZE);
+    block->difficulty_bits = (uint32_t)difficulty_bits;
+    block->nonce = 0;
+    memset(block->hash, 0, HASH_SIZE);
+    block->tx_count = tx_count;
+
+    return block;
+}
+
+// Copies a mined candidate into the node's arena, where it stays immutable and shareable
+Block* publish_block(Node* node, const Block* candidate) {
+    Block* block = block_alloc(&node->blocks, candidate->tx_count);
+    memcpy(block->hash, candidate->hash, HASH_SIZE);
+    block->index = candidate->index;
+    block->timestamp = candidate->timestamp;
+    memcpy(block->previous_hash, candidate->previous_hash, HASH_SIZE);
+    memcpy(block->merkle_root, candidate->merkle_root, HASH_SIZE);
+    block->difficulty_bits = candidate->difficulty_bits;
+    block->nonce = candidate->nonce;
+    block->tx_count = candidate->tx_count;
+    memcpy(block->transactions, candidate->transactions, sizeof(Transaction) * (size_t)candidate->tx_count);
+    return block;
+}
+
+bool address_equal(const Address* a, const Address* b) {
+    return memcmp(a->bytes, b->bytes, ADDRESS_SIZE) == 0;
+}
+
+// The all-zero address sends block rewards; it encodes a point of order 4, which no secret key produces
+bool address_is_zero(const Address* address) {
+    static const Address zero;
+    return address_equal(address, &zero);
+}
+
+// splitmix64 finalizer, to spread a seed and a node id into unrelated starting states
+uint64_t mix_seed(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Picks this process's address hash key from the system's random source, or from the clock,
+// process id and stack address where there is none. Only the index layout depends on it.
+void init_address_hash_key() {
+    uint64_t key = 0;
+    FILE* random = fopen("/dev/urandom", "rb");
+    if (random) {
+        if (fread(&key, sizeof(key), 1, random) != 1) key = 0;
+        fclose(random);
+    }
+    key ^= mix_seed((uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32));
+    key ^= mix_seed((uint64_t)(uintptr_t)&key ^ (uint64_t)(monotonic_seconds() * 1e9));
+    address_hash_key = key;
+}
+
+// Keyed mix of all 32 bytes. Anyone can pick the keys they send to, so the raw bytes would let
+// them grind addresses into one probe run; without the key they cannot aim.
+uint64_t address_hash(const Address* address) {
+    uint64_t hash = address_hash_key;
+    for (int i = 0; i < ADDRESS_SIZE; i += 8) {
+        uint64_t word;
+        memcpy(&word, address->bytes + i, sizeof(word));
+        hash = mix_seed(hash ^ word);
+    }
+    return hash;
+}
+
+void address_index_init(AddressIndex* index, size_t slot_count) {
+    index->slots = (uint64_t*)calloc(slot_count, sizeof(uint64_t));
+    index->mask = slot_count - 1;
+}
+
+void address_index_free(AddressIndex* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
+
+void address_index_insert(AddressIndex* index, const Address* address, size_t entry) {
+    uint64_t hash = address_hash(address);
+    size_t i = hash & index->mask;
+    while (index->slots[i] != 0) {
+        i = (i + 1) & index->mask;
+    }
+    index->slots[i] = (hash & 0xffffffff00000000ULL) | (uint64_t)(entry + 1);
+}
+
+// `entries` is the dense array the index points into; every entry starts with its Address
+long address_index_find(const AddressIndex* index, const Address* address, const void* entries, size_t stride) {
+    uint64_t hash = address_hash(address);
+    uint64_t tag = hash & 0xffffffff00000000ULL;
+    size_t i = hash & index->mask;
+    uint64_t slot;
+    while ((slot = index->slots[i]) != 0) {
+        if ((slot & 0xffffffff00000000ULL) == tag) {
+            size_t entry = (size_t)(slot & 0xffffffffULL) - 1;
+            if (address_equal((const Address*)((const char*)entries + entry * stride), address)) {
+                return (long)entry;
+            }
+        }
+        i = (i + 1) & index->mask;
+    }
+    return -1;
+}
+
+void account_directory_init(AccountDirectory* dir, size_t expected) {
+    size_t slots = ACCOUNT_TABLE_INITIAL_CAPACITY;
+    while (slots < expected * 2) slots *= 2;
+    dir->addresses = (Address*)malloc(sizeof(Address) * (slots / 2));
+    dir->keys = (AccountKey*)malloc(sizeof(AccountKey) * (slots / 2));
+    dir->count = 0;
+    dir->capacity = slots / 2;
+    address_index_init(&dir->index, slots);
+    pthread_rwlock_init(&dir->lock, NULL);
+}
+
+void account_directory_free(AccountDirectory* dir) {
+    free(dir->addresses);
+    free(dir->keys);
+    address_index_free(&dir->index);
+    pthread_rwlock_destroy(&dir->lock);
+    dir->addresses = NULL;
+    dir->keys = NULL;
+    dir->count = 0;
+    dir->capacity = 0;
+}
+
+// Id of a known address or -1; the caller holds the directory lock
+long account_id(const AccountDirectory* dir, const Address* address) {
+    return address_index_find(&dir->index, address, dir->addresses, sizeof(Address));
+}
+
+// Keeps the index at most half full; growing rehashes from the dense address array.
+// The caller holds the directory lock for writing.
+size_t account_id_or_create(AccountDirectory* dir, const Address* address) {
+    long id = account_id(dir, address);
+    if (id >= 0) return (size_t)id;
+
+    if (dir->count == dir->capacity) {
+        size_t slots = (dir->index.mask + 1) * 2;
+        dir->capacity = slots / 2;
+        dir->addresses = (Address*)realloc(dir->addresses, sizeof(Address) * dir->capacity);
+        dir->keys = (AccountKey*)realloc(dir->keys, sizeof(AccountKey) * dir->capacity);
+        address_index_free(&dir->index);
+        address_index_init(&dir->index, slots);
+        for (size_t e = 0; e < dir->count; e++) {
+            address_index_insert(&dir->index, &dir->addresses[e], e);
+        }
+    }
+
+    dir->addresses[dir->count] = *address;
+    dir->keys[dir->count].valid = ge_decode(&dir->keys[dir->count].point, address->bytes);
+    address_index_insert(&dir->index, address, dir->count);
+    return dir->count++;
+}
+
+StateSnapshot* state_create() {
+    StateSnapshot* state = (StateSnapshot*)malloc(sizeof(StateSnapshot));
+    atomic_init(&state->refs, 1);
+    state->page_count = 0;
+    state->pages = NULL;
+    return state;
+}
+
+StateSnapshot* state_retain(StateSnapshot* state) {
+    atomic_fetch_add_explicit(&state->refs, 1, memory_order_relaxed);
+    return state;
+}
+
+void state_page_release(StatePage* page) {
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+void state_release(StateSnapshot* state) {
+    if (state == NULL || atomic_fetch_sub_explicit(&state->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    for (size_t p = 0; p < state->page_count; p++) {
+        state_page_release(state->pages[p]);
+    }
+    free(state->pages);
+    free(state);
+}
+
+// A private child version sharing every page of `parent`
+StateSnapshot* state_fork(const StateSnapshot* parent) {
+    StateSnapshot* state = state_create();
+    state->page_count = parent->page_count;
+    state->pages = (StatePage**)malloc(sizeof(StatePage*) * (parent->page_count ? parent->page_count : 1));
+    for (size_t p = 0; p < parent->page_count; p++) {
+        state->pages[p] = parent->pages[p];
+        if (state->pages[p]) {
+            atomic_fetch_add_explicit(&state->pages[p]->refs, 1, memory_order_relaxed);
+        }
+    }
+    return state;
+}
+
+// Whether account `id` exists in this version, and its balance if so
+bool state_get(const StateSnapshot* state, size_t id, Amount* balance) {
+    size_t p = id / STATE_PAGE_SIZE;
+    const StatePage* page = p < state->page_count ? state->pages[p] : NULL;
+    if (page == NULL || !page->exists[id % STATE_PAGE_SIZE]) {
+        return false;
+    }
+    *balance = page->balances[id % STATE_PAGE_SIZE];
+    return true;
+}
+
+// The next nonce account `id` may use in this version; 0 for an account that never sent anything
+uint64_t state_nonce(const StateSnapshot* state, size_t id) {
+    size_t p = id / STATE_PAGE_SIZE;
+    const StatePage* page = p < state->page_count ? state->pages[p] : NULL;
+    return page ? page->nonces[id % STATE_PAGE_SIZE] : 0;
+}
+
+// Grows the page table to cover account `id`
+void state_reserve(StateSnapshot* state, size_t id) {
+    size_t p = id / STATE_PAGE_SIZE;
+    if (p >= state->page_count) {
+        size_t count = state->page_count ? state->page_count : 1;
+        while (count <= p) count *= 2;
+        state->pages = (StatePage**)realloc(state->pages, sizeof(StatePage*) * count);
+        memset(state->pages + state->page_count, 0, sizeof(StatePage*) * (count - state->page_count));
+        state->page_count = count;
+    }
+}
+
+// The page holding account `id`, for a version nobody else can see yet; a page still shared
+// with another version is copied first. Threads may write different pages at once once the
+// table is reserved.
+StatePage* state_page_for_write(StateSnapshot* state, size_t id) {
+    size_t p = id / STATE_PAGE_SIZE;
+    state_reserve(state, id);
+
+    StatePage* page = state->pages[p];
+    if (page == NULL) {
+        page = (StatePage*)calloc(1, sizeof(StatePage));
+        atomic_init(&page->refs, 1);
+        state->pages[p] = page;
+    } else if (atomic_load_explicit(&page->refs, memory_order_acquire) > 1) {
+        StatePage* copy = (StatePage*)malloc(sizeof(StatePage));
+        memcpy(copy->balances, page->balances, sizeof(page->balances));
+        memcpy(copy->nonces, page->nonces, sizeof(page->nonces));
+        memcpy(copy->exists, page->exists, sizeof(page->exists));
+        atomic_init(&copy->refs, 1);
+        state_page_release(page);
+        state->pages[p] = page = copy;
+    }
+    return page;
+}
+
+void state_set(StateSnapshot* state, size_t id, Amount balance) {
+    StatePage* page = state_page_for_write(state, id);
+    page->balances[id % STATE_PAGE_SIZE] = balance;
+    page->exists[id % STATE_PAGE_SIZE] = 1;
+}
+
+void state_set_nonce(StateSnapshot* state, size_t id, uint64_t nonce) {
+    state_page_for_write(state, id)->nonces[id % STATE_PAGE_SIZE] = nonce;
+}
+
+// One account as a transaction of the block leaves it
+typedef struct {
+    Amount balance;
+    uint64_t nonce;
+    bool exists;
+    bool written;    // Some transaction up to this one changed it, so the new version stores it
+} AccountVersion;
+
+// One transaction of a block being applied. Which accounts it touches is known before it
+// runs, so each read names the earlier transaction that writes that account last.
+typedef struct {
+    long sender;              // -1 for the coinbase and unknown senders
+    long receiver;            // -1 for a transfer from an unknown sender, which is skipped
+    int sender_prev;          // Earlier transaction touching the sender's account, -1 for the parent's state
+    int receiver_prev;
+    int sender_seen;          // Incarnation of sender_prev the last execution read, 0 for the parent's state
+    int receiver_seen;
+    AccountVersion sender_out;
+    AccountVersion receiver_out;
+    atomic_int incarnation;   // Executions published so far
+} ExecutionSlot;
+
+// An account the block touches and the last transaction that does
+typedef struct {
+    long account;
+    int last;
+} AccountTouch;
+
+typedef struct {
+    const Block* block;
+    const AccountDirectory* dir;
+    const StateSnapshot* parent;
+    StateSnapshot* state;
+    ExecutionSlot* slots;
+    AccountTouch* touched;    // In the order the block first touches them
+    size_t touched_count;
+    int* touch_index;         // Open addressing by account id into `touched`, -1 for an empty slot
+    size_t touch_mask;
+} BlockExecution;
+
+// Records that transaction `tx` touches `account` and returns the one that did before, or -1
+int touch_account(BlockExecution* run, long account, int tx) {
+    size_t i = (size_t)account & run->touch_mask;   // Ids are dense, so they spread on their own
+    while (run->touch_index[i] >= 0 && run->touched[run->touch_index[i]].account != account) {
+        i = (i + 1) & run->touch_mask;
+    }
+    if (run->touch_index[i] < 0) {
+        run->touch_index[i] = (int)run->touched_count;
+        run->touched[run->touched_count].account = account;
+        run->touched[run->touched_count++].last = tx;
+        return -1;
+    }
+    AccountTouch* touch = &run->touched[run->touch_index[i]];
+    int prev = touch->last;
+    touch->last = tx;
+    return prev;
+}
+
+const AccountVersion* slot_version(const ExecutionSlot* slot, long account) {
+    return slot->sender == account ? &slot->sender_out : &slot->receiver_out;
+}
+
+// What `account` holds before the transaction whose previous toucher is `prev`: that toucher's
+// output once it has published one, otherwise a guess from the parent's state for validation to catch
+AccountVersion read_account(const BlockExecution* run, long account, int prev, int* seen) {
+    if (prev >= 0) {
+        const ExecutionSlot* slot = &run->slots[prev];
+        *seen = atomic_load_explicit(&slot->incarnation, memory_order_acquire);
+        if (*seen > 0) {
+            return *slot_version(slot, account);
+        }
+    }
+    *seen = 0;
+    AccountVersion version;
+    version.exists = state_get(run->parent, (size_t)account, &version.balance);
+    version.nonce = state_nonce(run->parent, (size_t)account);
+    version.written = false;
+    return version;
+}
+
+// Runs transaction `i` on what it reads and publishes a new incarnation of its output: the
+// sender pays the amount and the fee and moves past the nonce, the receiver is credited. A
+// sender missing from the state, or a sum that would overflow, skips the transaction, which
+// then passes both accounts on unchanged.
+void execute_transaction(BlockExecution* run, int i) {
+    ExecutionSlot* slot = &run->slots[i];
+    const Transaction* tx = &run->block->transactions[i];
+    if (slot->receiver >= 0) {
+        AccountVersion from, to;
+        if (slot->sender >= 0) {
+            from = read_account(run, slot->sender, slot->sender_prev, &slot->sender_seen);
+        }
+        if (slot->receiver != slot->sender) {
+            to = read_account(run, slot->receiver, slot->receiver_prev, &slot->receiver_seen);
+        }
+        if (slot->receiver == slot->sender) {
+            to = from;
+        }
+        Amount cost, left = 0, credited;
+        bool applies = slot->sender < 0 ||
+                       (from.exists && amount_add(tx->amount, tx->fee, &cost) && amount_sub(from.balance, cost, &left));
+        Amount before = slot->receiver == slot->sender ? left : to.exists ? to.balance : 0;
+        if (applies && amount_add(before, tx->amount, &credited)) {
+            if (slot->sender >= 0) {
+                from.balance = left;
+                from.nonce = tx->nonce + 1;
+                from.written = true;
+            }
+            if (slot->receiver == slot->sender) {
+                to = from;
+            }
+            to.balance = credited;
+            to.exists = true;
+            to.written = true;
+            if (slot->receiver == slot->sender) {
+                from = to;
+            }
+        }
+        if (slot->sender >= 0) slot->sender_out = from;
+        slot->receiver_out = to;
+    }
+    int incarnation = atomic_load_explicit(&slot->incarnation, memory_order_relaxed);   // Only one thread runs it at a time
+    atomic_store_explicit(&slot->incarnation, incarnation + 1, memory_order_release);
+}
+
+// Whether the last execution of transaction `i` read the final output of each earlier toucher
+bool execution_valid(const BlockExecution* run, int i) {
+    const ExecutionSlot* slot = &run->slots[i];
+    if (slot->sender >= 0 && slot->sender_prev >= 0 &&
+        slot->sender_seen != atomic_load_explicit(&run->slots[slot->sender_prev].incarnation, memory_order_relaxed)) {
+        return false;
+    }
+    return slot->receiver < 0 || slot->receiver == slot->sender || slot->receiver_prev < 0 ||
+           slot->receiver_seen == atomic_load_explicit(&run->slots[slot->receiver_prev].incarnation, memory_order_relaxed);
+}
+
+// Each worker looks up the accounts of its slice of the block. The caller holds the directory's
+// read lock; receivers it does not know yet are left at -1 for the caller to add.
+void resolve_accounts_task(void* arg, int worker, int workers) {
+    BlockExecution* run = (BlockExecution*)arg;
+    int count = run->block->tx_count;
+    int begin = (int)((long)count * worker / workers);
+    int end = (int)((long)count * (worker + 1) / workers);
+    for (int i = begin; i < end; i++) {
+        const Transaction* tx = &run->block->transactions[i];
+        ExecutionSlot* slot = &run->slots[i];
+        atomic_init(&slot->incarnation, 0);
+        slot->sender = i > 0 ? account_id(run->dir, &tx->sender) : -1;
+        slot->receiver = i == 0 || slot->sender >= 0 ? account_id(run->dir, &tx->receiver) : -1;
+    }
+}
+
+// Each worker speculatively executes its slice of the block in order. A read whose earlier
+// toucher sits in another slice sees its output only if that worker got there first.
+void execute_transactions_task(void* arg, int worker, int workers) {
+    BlockExecution* run = (BlockExecution*)arg;
+    int count = run->block->tx_count;
+    int begin = (int)((long)count * worker / workers);
+    int end = (int)((long)count * (worker + 1) / workers);
+    for (int i = begin; i < end; i++) {
+        execute_transaction(run, i);
+    }
+}
+
+// Each worker stores the final version of every changed account on its share of the pages
+void commit_accounts_task(void* arg, int worker, int workers) {
+    BlockExecution* run = (BlockExecution*)arg;
+    for (size_t t = 0; t < run->touched_count; t++) {
+        long account = run->touched[t].account;
+        if ((size_t)account / STATE_PAGE_SIZE % (size_t)workers != (size_t)worker) continue;
+        const AccountVersion* version = slot_version(&run->slots[run->touched[t].last], account);
+        if (!version->written) continue;
+        StatePage* page = state_page_for_write(run->state, (size_t)account);
+        page->balances[account % STATE_PAGE_SIZE] = version->balance;
+        page->nonces[account % STATE_PAGE_SIZE] = version->nonce;
+        page->exists[account % STATE_PAGE_SIZE] = 1;
+    }
+}
+
+// The version `block` produces on top of `parent`: each sender pays the amount and the fee and
+// moves past the transaction's nonce, and the coinbase pays the miner the reward and the fees.
+// Transfers from unknown senders or that would overflow a balance are skipped, which only
+// matters for blocks a malicious node accepts unchecked.
+//
+// Large blocks run in parallel, Block-STM style. Resolving the account ids first gives every
+// transaction its read and write set, so each read knows which earlier transaction it depends
+// on. The workers execute their slices speculatively; one pass in block order then validates
+// each transaction's reads against the final incarnation of those earlier transactions and
+// re-executes only the ones that read a stale value, so the result is the serial one. Blocks
+// of transfers between distinct accounts re-execute nothing. The changed accounts are then
+// written page by page in parallel. The receiver of a transfer whose sender has no balance in
+// this state still gets an id, which no state sees.
+StateSnapshot* state_apply_block(AccountDirectory* dir, const StateSnapshot* parent, const Block* block) {
+    int count = block->tx_count;
+    bool parallel = count >= PARALLEL_EXECUTION_THRESHOLD;
+    BlockExecution run;
+    run.block = block;
+    run.dir = dir;
+    run.parent = parent;
+    run.state = state_fork(parent);
+    run.slots = (ExecutionSlot*)malloc(sizeof(ExecutionSlot) * (count ? count : 1));
+    run.touched = (AccountTouch*)malloc(sizeof(AccountTouch) * (count ? count * 2 : 1));   // Two per transaction at most
+    run.touched_count = 0;
+    size_t slots = 16;
+    while (slots < (size_t)count * 4) slots *= 2;
+    run.touch_index = (int*)malloc(sizeof(int) * slots);
+    run.touch_mask = slots - 1;
+    memset(run.touch_index, 0xff, sizeof(int) * slots);
+
+    pthread_rwlock_rdlock(&dir->lock);
+    if (parallel) {
+        worker_pool_run(&validation_pool, resolve_accounts_task, &run);
+    } else {
+        resolve_accounts_task(&run, 0, 1);
+    }
+    pthread_rwlock_unlock(&dir->lock);
+
+    // Every node applies every block, so the directory is only taken exclusively when a
+    // receiver has never been seen before; new ones get their ids in block order
+    bool known = true;
+    for (int i = 0; i < count && known; i++) {
+        known = run.slots[i].receiver >= 0 || (i > 0 && run.slots[i].sender < 0);
+    }
+    if (!known) {
+        pthread_rwlock_wrlock(&dir->lock);
+        for (int i = 0; i < count; i++) {
+            ExecutionSlot* slot = &run.slots[i];
+            if (slot->receiver < 0 && (i == 0 || slot->sender >= 0)) {
+                slot->receiver = (long)account_id_or_create(dir, &block->transactions[i].receiver);
+            }
+        }
+        pthread_rwlock_unlock(&dir->lock);
+    }
+
+    long last_account = -1;
+    for (int i = 0; i < count; i++) {
+        ExecutionSlot* slot = &run.slots[i];
+        if (slot->sender >= 0) {
+            slot->sender_prev = touch_account(&run, slot->sender, i);
+            if (slot->sender > last_account) last_account = slot->sender;
+        }
+        if (slot->receiver >= 0 && slot->receiver != slot->sender) {
+            slot->receiver_prev = touch_account(&run, slot->receiver, i);
+            if (slot->receiver > last_account) last_account = slot->receiver;
+        }
+    }
+
+    if (parallel) {
+        worker_pool_run(&validation_pool, execute_transactions_task, &run);
+    } else {
+        execute_transactions_task(&run, 0, 1);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!execution_valid(&run, i)) {
+            execute_transaction(&run, i);
+        }
+    }
+
+    if (last_account >= 0) {
+        state_reserve(run.state, (size_t)last_account);
+    }
+    if (parallel) {
+        worker_pool_run(&validation_pool, commit_accounts_task, &run);
+    } else {
+        commit_accounts_task(&run, 0, 1);
+    }
+    free(run.slots);
+    free(run.touched);
+    free(run.touch_index);
+    return run.state;
+}
+
+void mempool_init(Mempool* pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->entries = (PoolEntry*)malloc(sizeof(PoolEntry) * MEMPOOL_INITIAL_CAPACITY);
+    pool->entry_capacity = MEMPOOL_INITIAL_CAPACITY;
+    for (uint32_t e = 0; e < MEMPOOL_INITIAL_CAPACITY; e++) {
+        pool->entries[e].heap_index = e + 1 < MEMPOOL_INITIAL_CAPACITY ? e + 1 : POOL_NONE;
+    }
+    pool->free_head = 0;
+}
+
+void mempool_free(Mempool* pool) {
+    for (uint32_t a = 0; a < pool->sender_count; a++) {
+        free(pool->senders[a].entries);
+    }
+    free(pool->senders);
+    free(pool->entries);
+    free(pool->evict.items);
+    free(pool->ready.items);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Whether `a` goes into a block before `b`: it pays more, or as much and came first
+bool pool_entry_before(const PoolEntry* a, const PoolEntry* b) {
+    return a->tx.fee > b->tx.fee || (a->tx.fee == b->tx.fee && a->seq < b->seq);
+}
+
+// The eviction heap puts the entry that would be mined last on top; the ready heap the sender
+// with the entry that would be mined first
+bool pool_heap_before(const Mempool* pool, const PoolHeap* heap, uint32_t a, uint32_t b) {
+    if (heap == &pool->evict) {
+        return pool_entry_before(&pool->entries[b], &pool->entries[a]);
+    }
+    return pool_entry_before(&pool->entries[pool->senders[a].best], &pool->entries[pool->senders[b].best]);
+}
+
+void pool_heap_place(Mempool* pool, PoolHeap* heap, uint32_t i, uint32_t item) {
+    heap->items[i] = item;
+    if (heap == &pool->evict) {
+        pool->entries[item].heap_index = i;
+    } else {
+        pool->senders[item].ready_index = i;
+    }
+}
+
+// Moves the item at `i` up or down to where its current key belongs
+void pool_heap_sift(Mempool* pool, PoolHeap* heap, uint32_t i) {
+    uint32_t item = heap->items[i];
+    while (i > 0 && pool_heap_before(pool, heap, item, heap->items[(i - 1) / 2])) {
+        pool_heap_place(pool, heap, i, heap->items[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        uint32_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count && pool_heap_before(pool, heap, heap->items[child + 1], heap->items[child])) child++;
+        if (!pool_heap_before(pool, heap, heap->items[child], item)) break;
+        pool_heap_place(pool, heap, i, heap->items[child]);
+        i = child;
+    }
+    pool_heap_place(pool, heap, i, item);
+}
+
+void pool_heap_push(Mempool* pool, PoolHeap* heap, uint32_t item) {
+    if (heap->count == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : MEMPOOL_INITIAL_CAPACITY;
+        heap->items = (uint32_t*)realloc(heap->items, sizeof(uint32_t) * heap->capacity);
+    }
+    heap->items[heap->count++] = item;
+    pool_heap_sift(pool, heap, heap->count - 1);
+}
+
+void pool_heap_remove(Mempool* pool, PoolHeap* heap, uint32_t i) {
+    uint32_t last = heap->items[--heap->count];
+    if (i < heap->count) {
+        heap->items[i] = last;
+        pool_heap_sift(pool, heap, i);
+    }
+}
+
+// Position of the first of the sender's entries whose nonce is not below `nonce`
+uint32_t pool_sender_find(const Mempool* pool, const PoolSender* sender, uint64_t nonce) {
+    uint32_t lo = 0, hi = sender->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pool->entries[sender->entries[mid]].tx.nonce < nonce) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Drops the sender's entry at `position`: O(log n) for the heaps, plus a pass over the sender's
+// few other entries to shift them and, when this was its best, to find the next best
+void pool_remove(Mempool* pool, uint32_t account, uint32_t position) {
+    PoolSender* sender = &pool->senders[account];
+    uint32_t e = sender->entries[position];
+    pool_heap_remove(pool, &pool->evict, pool->entries[e].heap_index);
+    memmove(sender->entries + position, sender->entries + position + 1,
+            sizeof(uint32_t) * (sender->count - position - 1));
+    sender->count--;
+    if (pool->entries[e].tx.nonce >= sender->settled_nonce) {
+        sender->reserved -= pool->entries[e].tx.amount + pool->entries[e].tx.fee;
+    }
+    if (sender->count == 0) {
+        pool_heap_remove(pool, &pool->ready, sender->ready_index);
+        sender->ready_index = POOL_NONE;
+    } else if (sender->best == e) {
+        sender->best = sender->entries[0];
+        for (uint32_t i = 1; i < sender->count; i++) {
+            if (pool_entry_before(&pool->entries[sender->entries[i]], &pool->entries[sender->best])) {
+                sender->best = sender->entries[i];
+            }
+        }
+        pool_heap_sift(pool, &pool->ready, sender->ready_index);
+    }
+    pool->entries[e].heap_index = pool->free_head;
+    pool->free_head = e;
+    pool->count--;
+}
+
+// Drops the cheapest transaction, and its sender's later nonces, which cannot be mined without it
+void pool_evict_cheapest(Mempool* pool) {
+    const PoolEntry* cheapest = &pool->entries[pool->evict.items[0]];
+    uint32_t account = cheapest->sender;
+    uint64_t nonce = cheapest->tx.nonce;
+    PoolSender* sender = &pool->senders[account];
+    while (sender->count > 0 && pool->entries[sender->entries[sender->count - 1]].tx.nonce >= nonce) {
+        pool_remove(pool, account, sender->count - 1);
+    }
+}
+
+// Moves the sender's reservation to a state where its nonce is `nonce`: the entries below it are
+// mined there and reserve nothing more, and those at or past it reserve again when the state
+// is an earlier one. Entries cross settled_nonce only as the state advances or falls back, so
+// over a run of admissions this is O(1) per check.
+void pool_sender_settle(Mempool* pool, PoolSender* sender, uint64_t nonce) {
+    uint64_t low = nonce < sender->settled_nonce ? nonce : sender->settled_nonce;
+    uint64_t high = nonce < sender->settled_nonce ? sender->settled_nonce : nonce;
+    for (uint32_t i = pool_sender_find(pool, sender, low); i < sender->count; i++) {
+        const Transaction* tx = &pool->entries[sender->entries[i]].tx;
+        if (tx->nonce >= high) break;
+        sender->reserved += nonce < sender->settled_nonce ? tx->amount + tx->fee : -(tx->amount + tx->fee);
+    }
+    sender->settled_nonce = nonce;
+}
+
+// Admits a transaction that passed validation against `from`, the sender's position in the
+// reference state. It must be affordable on top of what the sender's pending transactions
+// already reserve. One with the nonce of a pending transaction replaces it only by paying a
+// higher fee. A full pool evicts its cheapest transactions, so a newcomer that pays the least
+// is turned away.
+TransactionVerdict mempool_add(Mempool* pool, const Transaction* tx, const SenderState* from) {
+    size_t account = from->account;
+    if (account >= pool->sender_count) {
+        uint32_t count = pool->sender_count ? pool->sender_count : MEMPOOL_INITIAL_CAPACITY;
+        while (count <= account) count *= 2;
+        pool->senders = (PoolSender*)realloc(pool->senders, sizeof(PoolSender) * count);
+        for (uint32_t a = pool->sender_count; a < count; a++) {
+            memset(&pool->senders[a], 0, sizeof(PoolSender));
+            pool->senders[a].ready_index = POOL_NONE;
+        }
+        pool->sender_count = count;
+    }
+    PoolSender* sender = &pool->senders[account];
+    pool_sender_settle(pool, sender, from->nonce);
+    uint32_t position = pool_sender_find(pool, sender, tx->nonce);
+    Amount cost = tx->amount + tx->fee;   // Admission checked it against a balance, as it did every pending cost
+
+    if (position < sender->count && pool->entries[sender->entries[position]].tx.nonce == tx->nonce) {
+        PoolEntry* pending = &pool->entries[sender->entries[position]];
+        Amount pending_cost = pending->tx.amount + pending->tx.fee;
+        if (!(tx->fee > pending->tx.fee)) {
+            return TX_UNDERPRICED;
+        }
+        if (sender->reserved - pending_cost + cost > from->balance) {
+            return TX_OVERSPENT;
+        }
+        sender->reserved += cost - pending_cost;
+        pending->tx = *tx;
+        pending->seq = pool->next_seq++;
+        pool_heap_sift(pool, &pool->evict, pending->heap_index);
+        if (pool_entry_before(pending, &pool->entries[sender->best])) {
+            sender->best = sender->entries[position];
+        }
+        pool_heap_sift(pool, &pool->ready, sender->ready_index);
+        return TX_REPLACED;
+    }
+    if (sender->reserved + cost > from->balance) {
+        return TX_OVERSPENT;
+    }
+
+    if (pool->free_head == POOL_NONE) {
+        uint32_t capacity = pool->entry_capacity * 2;
+        pool->entries = (PoolEntry*)realloc(pool->entries, sizeof(PoolEntry) * capacity);
+        for (uint32_t e = pool->entry_capacity; e < capacity; e++) {
+            pool->entries[e].heap_index = e + 1 < capacity ? e + 1 : POOL_NONE;
+        }
+        pool->free_head = pool->entry_capacity;
+        pool->entry_capacity = capacity;
+    }
+    uint32_t e = pool->free_head;
+    PoolEntry* entry = &pool->entries[e];
+    pool->free_head = entry->heap_index;
+    entry->tx = *tx;
+    entry->seq = pool->next_seq++;
+    entry->sender = (uint32_t)account;
+
+    if (sender->count == sender->capacity) {
+        sender->capacity = sender->capacity ? sender->capacity * 2 : 4;
+        sender->entries = (uint32_t*)realloc(sender->entries, sizeof(uint32_t) * sender->capacity);
+    }
+    memmove(sender->entries + position + 1, sender->entries + position,
+            sizeof(uint32_t) * (sender->count - position));
+    sender->entries[position] = e;
+    sender->count++;
+    sender->reserved += cost;
+    pool->count++;
+    pool_heap_push(pool, &pool->evict, e);
+    if (sender->count == 1) {
+        sender->best = e;
+        pool_heap_push(pool, &pool->ready, (uint32_t)account);
+    } else if (pool_entry_before(entry, &pool->entries[sender->best])) {
+        sender->best = e;
+        pool_heap_sift(pool, &pool->ready, sender->ready_index);
+    }
+
+    while (pool->count > MEMPOOL_MAX_TRANSACTIONS) {
+        pool_evict_cheapest(pool);
+    }
+    position = pool_sender_find(pool, sender, tx->nonce);
+    return position < sender->count && sender->entries[position] == e ? TX_VALID : TX_UNDERPRICED;
+}
+
+// Forgets the account's pending transactions with a nonce below `nonce`
+void mempool_drop_below(Mempool* pool, size_t account, uint64_t nonce) {
+    if (account >= pool->sender_count) return;
+    PoolSender* sender = &pool->senders[account];
+    uint32_t position = pool_sender_find(pool, sender, nonce);
+    while (position-- > 0) {
+        pool_remove(pool, (uint32_t)account, position);
+    }
+}
+
+// A step of block building: a ready-heap position still to expand, or the next transaction of a
+// sender whose run of nonces is being followed
+typedef struct {
+    uint32_t entry;        // Orders the step
+    uint32_t ready;        // Ready-heap position, or POOL_NONE for a sender's next transaction
+    uint32_t position;     // Of `entry` among its sender's
+    Amount balance;        // What the sender has left for `entry` and the ones after it
+} SelectionStep;
+
+typedef struct {
+    SelectionStep* steps;
+    size_t count;
+    size_t capacity;
+} SelectionQueue;
+
+void selection_push(SelectionQueue* queue, const Mempool* pool, const SelectionStep* step) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->steps = (SelectionStep*)realloc(queue->steps, sizeof(SelectionStep) * queue->capacity);
+    }
+    size_t i = queue->count++;
+    while (i > 0 && pool_entry_before(&pool->entries[step->entry], &pool->entries[queue->steps[(i - 1) / 2].entry])) {
+        queue->steps[i] = queue->steps[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->steps[i] = *step;
+}
+
+SelectionStep selection_pop(SelectionQueue* queue, const Mempool* pool) {
+    SelectionStep top = queue->steps[0];
+    SelectionStep last = queue->steps[--queue->count];
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->count) break;
+        if (child + 1 < queue->count &&
+            pool_entry_before(&pool->entries[queue->steps[child + 1].entry], &pool->entries[queue->steps[child].entry])) child++;
+        if (!pool_entry_before(&pool->entries[queue->steps[child].entry], &pool->entries[last.entry])) break;
+        queue->steps[i] = queue->steps[child];
+        i = child;
+    }
+    if (queue->count > 0) queue->steps[i] = last;
+    return top;
+}
+
+// Fills `out` with up to `limit` entries that can follow `state`, the best-paying first. Each
+// sender contributes its consecutive nonces from its nonce in `state` while its balance covers
+// them, every one competing on its own fee once the one before it is in. Senders are reached
+// in ready-heap order without popping the heap: expanding a position queues its two children.
+// A sender's best entry bounds all of its entries, so a sender is always reached before any of
+// its transactions could be due, and only the senders that make it into the block and their
+// fringe are looked at. That makes building a block O(k log k) for k transactions, however
+// many are pending.
+int mempool_select(const Mempool* pool, const StateSnapshot* state, int limit, uint32_t* out) {
+    SelectionQueue queue = {NULL, 0, 0};
+    SelectionStep step;
+    if (pool->ready.count > 0) {
+        step.ready = 0;
+        step.entry = pool->senders[pool->ready.items[0]].best;
+        selection_push(&queue, pool, &step);
+    }
+
+    int count = 0;
+    while (queue.count > 0 && count < limit) {
+        step = selection_pop(&queue, pool);
+        if (step.ready == POOL_NONE) {
+            const PoolEntry* entry = &pool->entries[step.entry];
+            Amount cost = entry->tx.amount + entry->tx.fee;
+            if (cost > step.balance) continue;
+            out[count++] = step.entry;
+            const PoolSender* sender = &pool->senders[entry->sender];
+            uint32_t next = step.position + 1;
+            if (next < sender->count && pool->entries[sender->entries[next]].tx.nonce == entry->tx.nonce + 1) {
+                SelectionStep chain = {sender->entries[next], POOL_NONE, next, step.balance - cost};
+                selection_push(&queue, pool, &chain);
+            }
+            continue;
+        }
+
+        for (uint32_t child = 2 * step.ready + 1; child <= 2 * step.ready + 2 && child < pool->ready.count; child++) {
+            SelectionStep expand = {pool->senders[pool->ready.items[child]].best, child, 0, 0};
+            selection_push(&queue, pool, &expand);
+        }
+        uint32_t account = pool->ready.items[step.ready];
+        const PoolSender* sender = &pool->senders[account];
+        Amount balance;
+        if (!state_get(state, account, &balance)) continue;
+        uint64_t nonce = state_nonce(state, account);
+        uint32_t position = pool_sender_find(pool, sender, nonce);
+        if (position < sender->count && pool->entries[sender->entries[position]].tx.nonce == nonce) {
+            SelectionStep chain = {sender->entries[position], POOL_NONE, position, balance};
+            selection_push(&queue, pool, &chain);
+        }
+    }
+    free(queue.steps);
+    return count;
+}
+
+// How many transactions fit beside the coinbase under the block limits; they all encode to the same size
+int block_transaction_limit() {
+    size_t fit = max_block_bytes > BLOCK_HEADER_SIZE ? (max_block_bytes - BLOCK_HEADER_SIZE) / TX_ENCODED_SIZE : 0;
+    int limit = fit < (size_t)max_block_transactions ? (int)fit : max_block_transactions;
+    return limit > 0 ? limit - 1 : 0;
+}
+
+void block_hash_index_init(BlockHashIndex* index, size_t slot_count) {
+    index->slots = (uint64_t*)calloc(slot_count, sizeof(uint64_t));
+    index->mask = slot_count - 1;
+}
+
+void block_hash_index_free(BlockHashIndex* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
+
+// Proof of work zeroes the leading bytes of a block hash, so the key comes from its last eight,
+// mixed with the process's address hash key
+uint64_t block_hash_key(const uint8_t hash[HASH_SIZE]) {
+    uint64_t word;
+    memcpy(&word, hash + HASH_SIZE - sizeof(word), sizeof(word));
+    return mix_seed(address_hash_key ^ word);
+}
+
+void block_hash_index_insert(BlockHashIndex* index, const uint8_t hash[HASH_SIZE], int entry) {
+    uint64_t key = block_hash_key(hash);
+    size_t i = key & index->mask;
+    while (index->slots[i] != 0) {
+        i = (i + 1) & index->mask;
+    }
+    index->slots[i] = (key & 0xffffffff00000000ULL) | (uint64_t)(entry + 1);
+}
+
+void chain_init(Blockchain* chain) {
+    chain->entries = (TreeEntry*)malloc(sizeof(TreeEntry) * CHAIN_INITIAL_CAPACITY);
+    chain->entry_count = 0;
+    chain->entry_capacity = CHAIN_INITIAL_CAPACITY;
+    block_hash_index_init(&chain->by_hash, CHAIN_INITIAL_CAPACITY * 2);
+    chain->active = (int*)malloc(sizeof(int) * CHAIN_INITIAL_CAPACITY);
+    chain->length = 0;
+    chain->active_capacity = CHAIN_INITIAL_CAPACITY;
+    chain->base = 0;
+}
+
+// Drops the handles only; block memory belongs to the publishing nodes' arenas
+void chain_free(Blockchain* chain) {
+    for (int e = 0; e < chain->entry_count; e++) {
+        state_release(chain->entries[e].state);
+    }
+    free(chain->entries);
+    block_hash_index_free(&chain->by_hash);
+    free(chain->active);
+    chain->entries = NULL;
+    chain->entry_count = 0;
+    chain->entry_capacity = 0;
+    chain->active = NULL;
+    chain->length = 0;
+    chain->active_capacity = 0;
+}
+
+// Expected hashes to find a block at its difficulty
+uint64_t block_work(const Block* block) {
+    return 1ULL << (block->difficulty_bits < 63 ? block->difficulty_bits : 63);
+}
+
+const TreeEntry* chain_tip_entry(const Blockchain* chain) {
+    return chain->length > 0 ? &chain->entries[chain->active[chain->length - 1]] : NULL;
+}
+
+const Block* chain_tip(const Blockchain* chain) {
+    return chain->length > 0 ? chain->entries[chain->active[chain->length - 1]].block : NULL;
+}
+
+// Block at `height` on the best chain
+const Block* chain_at(const Blockchain* chain, int height) {
+    return height >= chain->base && height < chain->length ? chain->entries[chain->active[height]].block : NULL;
+}
+
+bool chain_is_active(const Blockchain* chain, int entry) {
+    int height = chain->entries[entry].block->index;
+    return height < chain->length && chain->active[height] == entry;
+}
+
+// Entry of the block with this hash on any branch, or -1
+int chain_find(const Blockchain* chain, const uint8_t hash[HASH_SIZE]) {
+    uint64_t key = block_hash_key(hash);
+    uint64_t tag = key & 0xffffffff00000000ULL;
+    size_t i = key & chain->by_hash.mask;
+    uint64_t slot;
+    while ((slot = chain->by_hash.slots[i]) != 0) {
+        if ((slot & 0xffffffff00000000ULL) == tag) {
+            int entry = (int)(slot & 0xffffffffULL) - 1;
+            if (memcmp(chain->entries[entry].block->hash, hash, HASH_SIZE) == 0) {
+                return entry;
+            }
+        }
+        i = (i + 1) & chain->by_hash.mask;
+    }
+    return -1;
+}
+
+// Adds a shared block to the tree under `parent`, taking a reference to it and adopting the
+// caller's reference to `state`; the best chain is unchanged
+int chain_add(Blockchain* chain, const Block* block, int parent, StateSnapshot* state) {
+    if (chain->entry_count == chain->entry_capacity) {
+        size_t slots = (chain->by_hash.mask + 1) * 2;
+        chain->entry_capacity = (int)(slots / 2);
+        chain->entries = (TreeEntry*)realloc(chain->entries, sizeof(TreeEntry) * (size_t)chain->entry_capacity);
+        block_hash_index_free(&chain->by_hash);
+        block_hash_index_init(&chain->by_hash, slots);
+        for (int e = 0; e < chain->entry_count; e++) {
+            block_hash_index_insert(&chain->by_hash, chain->entries[e].block->hash, e);
+        }
+    }
+
+    int e = chain->entry_count++;
+    TreeEntry* entry = &chain->entries[e];
+    entry->block = block_retain(block);
+    entry->parent = parent;
+    entry->work = (parent >= 0 ? chain->entries[parent].work : 0) + block_work(block);
+    entry->state = state;
+    block_hash_index_insert(&chain->by_hash, block->hash, e);
+    return e;
+}
+
+// Makes `entry` the best chain's block at its height and truncates the chain there.
+// Heights below the base are never read, so a restored chain leaves them unset.
+void chain_set_active(Blockchain* chain, int entry) {
+    int height = chain->entries[entry].block->index;
+    if (height >= chain->active_capacity) {
+        while (height >= chain->active_capacity) chain->active_capacity *= 2;
+        chain->active = (int*)realloc(chain->active, sizeof(int) * (size_t)chain->active_capacity);
+    }
+    chain->active[height] = entry;
+    chain->length = height + 1;
+}
+
+// Drops the snapshots of best-chain blocks more than STATE_HISTORY_DEPTH below the tip.
+// Walks down only until it meets a block pruned earlier, so each call does O(1) work.
+void chain_prune_states(Blockchain* chain) {
+    for (int height = chain->length - 1 - STATE_HISTORY_DEPTH; height >= chain->base; height--) {
+        TreeEntry* entry = &chain->entries[chain->active[height]];
+        if (entry->state == NULL) break;
+        state_release(entry->state);
+        entry->state = NULL;
+    }
+}
+
+// A reference to the state at the node's tip, which stays readable after the chain lock is dropped
+StateSnapshot* chain_tip_state(Blockchain* chain) {
+    pthread_mutex_lock(&chain->lock);
+    StateSnapshot* state = state_retain(chain_tip_entry(chain)->state);
+    pthread_mutex_unlock(&chain->lock);
+    return state;
+}
+
+// CRC-32 (IEEE 802.3, as in zlib) a nibble at a time
+uint32_t crc32(const uint8_t* data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+// Record payload: header | tx_count u32 | transactions. The block hash is the SHA-256 of its first
+// BLOCK_HEADER_SIZE bytes, so it is not stored.
+void encode_block(const Block* block, ByteBuffer* buf) {
+    encode_block_header(block, byte_buffer_extend(buf, BLOCK_HEADER_SIZE));
+    put_u32_le(byte_buffer_extend(buf, 4), (uint32_t)block->tx_count);
+    for (int i = 0; i < block->tx_count; i++) {
+        encode_transaction(&block->transactions[i], buf);
+    }
+}
+
+// NULL when the payload is not a well-formed block
+Block* decode_block(Arena* arena, const uint8_t* in, size_t len) {
+    if (len < BLOCK_HEADER_SIZE + 4) {
+        return NULL;
+    }
+    uint32_t tx_count = get_u32_le(in + BLOCK_HEADER_SIZE);
+    if (tx_count > (uint32_t)MAX_BLOCK_TRANSACTIONS || len != BLOCK_HEADER_SIZE + 4 + (size_t)tx_count * TX_ENCODED_SIZE) {
+        return NULL;
+    }
+
+    Block* block = block_alloc(arena, (int)tx_count);
+    block->index = (int)get_u32_le(in);
+    block->timestamp = (time_t)(int64_t)get_u64_le(in + 4);
+    memcpy(block->previous_hash, in + 12, HASH_SIZE);
+    memcpy(block->merkle_root, in + 44, HASH_SIZE);
+    block->difficulty_bits = get_u32_le(in + 76);
+    block->nonce = get_u64_le(in + HEADER_NONCE_OFFSET);
+    block->tx_count = (int)tx_count;
+    for (uint32_t i = 0; i < tx_count; i++) {
+        decode_transaction(in + BLOCK_HEADER_SIZE + 4 + (size_t)i * TX_ENCODED_SIZE, &block->transactions[i]);
+    }
+    sha256(in, BLOCK_HEADER_SIZE, block->hash);
+    return block;
+}
+
+// Read-only view of a whole file; Windows builds read it into memory instead
+bool map_file(const char* path, MappedFile* map) {
+    map->data = NULL;
+    map->size = 0;
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size > 0) {
+        map->data = (uint8_t*)malloc((size_t)size);
+        map->size = fread(map->data, 1, (size_t)size, file);
+    }
+    fclose(file);
+    return true;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            map->data = (uint8_t*)data;
+            map->size = (size_t)info.st_size;
+        }
+    }
+    close(fd);
+    return true;
+#endif
+}
+
+void unmap_file(MappedFile* map) {
+    if (map->data) {
+#ifdef _WIN32
+        free(map->data);
+#else
+        munmap(map->data, map->size);
+#endif
+    }
+    map->data = NULL;
+    map->size = 0;
+}
+
+// Creates every missing directory along `path`
+bool make_directories(const char* path) {
+    char partial[PATH_SIZE];
+    size_t len = strlen(path);
+    if (len == 0 || len >= PATH_SIZE) return false;
+    for (size_t i = 1; i <= len; i++) {
+        if (path[i] != '/' && path[i] != '\0') continue;
+        memcpy(partial, path, i);
+        partial[i] = '\0';
+#ifdef _WIN32
+        int result = _mkdir(partial);
+#else
+        int result = mkdir(partial, 0755);
+#endif
+        if (result != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+void block_log_path(const BlockLog* log, uint32_t segment, char out[PATH_SIZE]) {
+    snprintf(out, PATH_SIZE, "%s/blocks-%05u.dat", log->dir, segment);
+}
+
+void block_log_add_entry(BlockLog* log, const BlockLogEntry* entry) {
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : CHAIN_INITIAL_CAPACITY;
+        log->entries = (BlockLogEntry*)realloc(log->entries, sizeof(BlockLogEntry) * log->capacity);
+    }
+    log->entries[log->count++] = *entry;
+}
+
+void block_log_write_index_entry(FILE* index, const BlockLogEntry* entry) {
+    uint8_t out[BLOCK_LOG_INDEX_ENTRY];
+    memcpy(out, entry->hash, HASH_SIZE);
+    put_u32_le(out + HASH_SIZE, entry->segment);
+    put_u32_le(out + HASH_SIZE + 4, entry->length);
+    put_u64_le(out + HASH_SIZE + 8, entry->offset);
+    fwrite(out, 1, BLOCK_LOG_INDEX_ENTRY, index);
+}
+
+// A record at `offset` that fits in the mapping and matches its checksum; returns its payload length
+bool block_log_check_record(const MappedFile* map, uint64_t offset, uint32_t* length) {
+    if (offset + BLOCK_LOG_RECORD_HEADER > map->size) return false;
+    const uint8_t* record = map->data + offset;
+    uint32_t len = get_u32_le(record);
+    if (len < BLOCK_HEADER_SIZE || offset + BLOCK_LOG_RECORD_HEADER + len > map->size) return false;
+    if (crc32(record + BLOCK_LOG_RECORD_HEADER, len) != get_u32_le(record + 4)) return false;
+    *length = len;
+    return true;
+}
+
+uint64_t block_log_entry_end(const BlockLogEntry* entry) {
+    return entry->offset + BLOCK_LOG_RECORD_HEADER + entry->length;
+}
+
+// Points the append handles at the end of the last record
+bool block_log_reopen(BlockLog* log) {
+    char path[PATH_SIZE];
+    if (log->segment) fclose(log->segment);
+    if (log->index) fclose(log->index);
+    log->segment_id = log->count > 0 ? log->entries[log->count - 1].segment : 0;
+    log->segment_size = log->count > 0 ? block_log_entry_end(&log->entries[log->count - 1]) : 0;
+    block_log_path(log, log->segment_id, path);
+    log->segment = fopen(path, "ab");
+    snprintf(path, PATH_SIZE, "%s/blocks.idx", log->dir);
+    log->index = fopen(path, "ab");
+    return log->segment != NULL && log->index != NULL;
+}
+
+// Makes the log end after its first `keep` records: rewrites the index, cuts the last segment
+// there and deletes every later one
+bool block_log_truncate(BlockLog* log, size_t keep) {
+    char path[PATH_SIZE];
+    log->count = keep;
+    uint32_t segment = keep > 0 ? log->entries[keep - 1].segment : 0;
+    uint64_t end = keep > 0 ? block_log_entry_end(&log->entries[keep - 1]) : 0;
+
+    snprintf(path, PATH_SIZE, "%s/blocks.idx", log->dir);
+    FILE* index = fopen(path, "wb");
+    if (index) {
+        for (size_t i = 0; i < keep; i++) {
+            block_log_write_index_entry(index, &log->entries[i]);
+        }
+        fclose(index);
+    }
+
+    block_log_path(log, segment, path);
+#ifdef _WIN32
+    int fd = _open(path, _O_RDWR);
+    if (fd >= 0) {
+        _chsize_s(fd, (long long)end);
+        _close(fd);
+    }
+#else
+    if (truncate(path, (off_t)end) != 0 && errno != ENOENT) {
+        printf("Cannot truncate %s\n", path);
+    }
+#endif
+    for (uint32_t later = segment + 1;; later++) {
+        block_log_path(log, later, path);
+        if (remove(path) != 0) break;
+    }
+    return block_log_reopen(log);
+}
+
+// Opens or creates the log in `dir`. Index entries whose record is missing or damaged are
+// dropped, and records written after the last index update (a crash between the two
+// writes) are checked and indexed, so the log always ends on its last intact record.
+bool block_log_open(BlockLog* log, const char* dir) {
+    memset(log, 0, sizeof(*log));
+    if (strlen(dir) >= sizeof(log->dir) || !make_directories(dir)) {
+        return false;
+    }
+    snprintf(log->dir, sizeof(log->dir), "%s", dir);
+
+    char path[PATH_SIZE];
+    snprintf(path, PATH_SIZE, "%s/blocks.idx", log->dir);
+    MappedFile index;
+    map_file(path, &index);
+    size_t indexed = index.size / BLOCK_LOG_INDEX_ENTRY;
+    for (size_t i = 0; i < indexed; i++) {
+        const uint8_t* in = index.data + i * BLOCK_LOG_INDEX_ENTRY;
+        BlockLogEntry entry;
+        memcpy(entry.hash, in, HASH_SIZE);
+        entry.segment = get_u32_le(in + HASH_SIZE);
+        entry.length = get_u32_le(in + HASH_SIZE + 4);
+        entry.offset = get_u64_le(in + HASH_SIZE + 8);
+        block_log_add_entry(log, &entry);
+    }
+    bool dirty = index.size % BLOCK_LOG_INDEX_ENTRY != 0;
+    unmap_file(&index);
+
+    // Indexed records must lie inside their segments, in order; only lengths are checked here,
+    // checksums are verified when a record is read
+    MappedFile map = {NULL, 0};
+    uint32_t mapped = UINT32_MAX;
+    size_t valid = 0;
+    uint64_t end = 0;
+    for (; valid < log->count; valid++) {
+        const BlockLogEntry* entry = &log->entries[valid];
+        const BlockLogEntry* previous = valid > 0 ? &log->entries[valid - 1] : NULL;
+        uint64_t expected = previous && previous->segment == entry->segment ? block_log_entry_end(previous) : 0;
+        if (entry->offset != expected || (previous && entry->segment < previous->segment)) break;
+        if (entry->segment != mapped) {
+            unmap_file(&map);
+            block_log_path(log, entry->segment, path);
+            map_file(path, &map);
+            mapped = entry->segment;
+        }
+        if (block_log_entry_end(entry) > map.size) break;
+        end = block_log_entry_end(entry);
+    }
+    dirty = dirty || valid < log->count;
+    log->count = valid;
+
+    // Pick up records the index missed, segment after segment
+    uint32_t segment = valid > 0 ? log->entries[valid - 1].segment : 0;
+    while (true) {
+        if (segment != mapped) {
+            unmap_file(&map);
+            block_log_path(log, segment, path);
+            if (!map_file(path, &map)) break;
+            mapped = segment;
+        }
+        uint32_t length;
+        while (block_log_check_record(&map, end, &length)) {
+            BlockLogEntry entry;
+            sha256(map.data + end + BLOCK_LOG_RECORD_HEADER, BLOCK_HEADER_SIZE, entry.hash);
+            entry.segment = segment;
+            entry.length = length;
+            entry.offset = end;
+            block_log_add_entry(log, &entry);
+            end = block_log_entry_end(&entry);
+            dirty = true;
+        }
+        if (end != map.size) {
+            dirty = true;   // Torn or damaged tail
+            break;
+        }
+        block_log_path(log, segment + 1, path);
+        struct stat info;
+        if (stat(path, &info) != 0) break;
+        segment++;
+        end = 0;
+    }
+    unmap_file(&map);
+
+    if (!(dirty ? block_log_truncate(log, log->count) : block_log_reopen(log))) {
+        if (log->segment) fclose(log->segment);
+        if (log->index) fclose(log->index);
+        free(log->entries);
+        memset(log, 0, sizeof(*log));
+        return false;
+    }
+    return true;
+}
+
+bool block_log_enabled(const BlockLog* log) {
+    return log->dir[0] != '\0';
+}
+
+// Appends the record, then its index entry; both are flushed so a restarted process sees them
+bool block_log_append(BlockLog* log, const Block* block) {
+    ByteBuffer payload;
+    byte_buffer_init(&payload);
+    encode_block(block, &payload);
+    uint8_t header[BLOCK_LOG_RECORD_HEADER];
+    put_u32_le(header, (uint32_t)payload.size);
+    put_u32_le(header + 4, crc32(payload.data, payload.size));
+
+    uint64_t record_size = BLOCK_LOG_RECORD_HEADER + payload.size;
+    if (log->segment_size > 0 && log->segment_size + record_size > BLOCK_LOG_SEGMENT_SIZE) {
+        char path[PATH_SIZE];
+        fclose(log->segment);
+        log->segment_id++;
+        log->segment_size = 0;
+        block_log_path(log, log->segment_id, path);
+        log->segment = fopen(path, "ab");
+        if (log->segment == NULL) {
+            byte_buffer_free(&payload);
+            return false;
+        }
+    }
+
+    BlockLogEntry entry;
+    memcpy(entry.hash, block->hash, HASH_SIZE);
+    entry.segment = log->segment_id;
+    entry.length = (uint32_t)payload.size;
+    entry.offset = log->segment_size;
+    bool written = fwrite(header, 1, sizeof(header), log->segment) == sizeof(header) &&
+                   fwrite(payload.data, 1, payload.size, log->segment) == payload.size &&
+                   fflush(log->segment) == 0;
+    byte_buffer_free(&payload);
+    if (!written) {
+        return false;
+    }
+    log->segment_size += record_size;
+    block_log_write_index_entry(log->index, &entry);
+    fflush(log->index);
+    block_log_add_entry(log, &entry);
+    return true;
+}
+
+// Decodes record `n` into `arena`; NULL if it fails its checksum or does not hash to its index entry
+Block* block_log_read(BlockLog* log, size_t n, Arena* arena) {
+    const BlockLogEntry* entry = &log->entries[n];
+    if (entry->segment >= log->map_count) {
+        uint32_t count = entry->segment + 1;
+        log->maps = (MappedFile*)realloc(log->maps, sizeof(MappedFile) * count);
+        memset(log->maps + log->map_count, 0, sizeof(MappedFile) * (count - log->map_count));
+        log->map_count = count;
+    }
+    MappedFile* map = &log->maps[entry->segment];
+    if (block_log_entry_end(entry) > map->size) {
+        char path[PATH_SIZE];
+        unmap_file(map);
+        block_log_path(log, entry->segment, path);
+        map_file(path, map);
+    }
+
+    uint32_t length;
+    if (!block_log_check_record(map, entry->offset, &length) || length != entry->length) {
+        return NULL;
+    }
+    Block* block = decode_block(arena, map->data + entry->offset + BLOCK_LOG_RECORD_HEADER, length);
+    if (block && memcmp(block->hash, entry->hash, HASH_SIZE) != 0) {
+        return NULL;   // Left in the arena, which is only released with the network
+    }
+    return block;
+}
+
+void block_log_close(BlockLog* log) {
+    if (!block_log_enabled(log)) return;
+    fclose(log->segment);
+    fclose(log->index);
+    for (uint32_t i = 0; i < log->map_count; i++) {
+        unmap_file(&log->maps[i]);
+    }
+    free(log->maps);
+    free(log->entries);
+    memset(log, 0, sizeof(*log));
+}
+
+// Interns a human-readable name. The account's signing key is derived from the name, so every
+// run and every restart sees the same addresses; a real wallet would draw it at random.
+Address register_name(const char* name) {
+    static const char key_domain[] = "TP account key ";
+    uint8_t seed[ED25519_SEED_SIZE];
+    Sha256Ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, key_domain, sizeof(key_domain) - 1);
+    sha256_update(&ctx, name, strlen(name));
+    sha256_final(&ctx, seed);
+    Address address;
+    ed25519_public_key(seed, address.bytes);
+
+    pthread_mutex_lock(&name_lock);
+    NameTable* table = &address_names;
+    if (table->entries == NULL) {
+        table->entries = (AddressName*)malloc(sizeof(AddressName) * ACCOUNT_TABLE_INITIAL_CAPACITY);
+        table->entry_capacity = ACCOUNT_TABLE_INITIAL_CAPACITY;
+        address_index_init(&table->index, ACCOUNT_TABLE_INITIAL_CAPACITY * 2);
+    }
+    if (address_index_find(&table->index, &address, table->entries, sizeof(AddressName)) < 0) {
+        if (table->count == table->entry_capacity) {
+            size_t slots = (table->index.mask + 1) * 2;
+            table->entry_capacity = slots / 2;
+            table->entries = (AddressName*)realloc(table->entries, sizeof(AddressName) * table->entry_capacity);
+            address_index_free(&table->index);
+            address_index_init(&table->index, slots);
+            for (size_t e = 0; e < table->count; e++) {
+                address_index_insert(&table->index, &table->entries[e].address, e);
+            }
+        }
+        AddressName* entry = &table->entries[table->count];
+        entry->address = address;
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+        memcpy(entry->seed, seed, ED25519_SEED_SIZE);
+        entry->next_nonce = 0;
+        address_index_insert(&table->index, &address, table->count);
+        table->count++;
+    }
+    pthread_mutex_unlock(&name_lock);
+
+    return address;
+}
+
+// Registered name, or the first bytes in hex for addresses nobody named
+void format_address(const Address* address, char out[ADDRESS_NAME_SIZE]) {
+    pthread_mutex_lock(&name_lock);
+    long entry = address_names.entries
+        ? address_index_find(&address_names.index, address, address_names.entries, sizeof(AddressName))
+        : -1;
+    if (entry >= 0) {
+        memcpy(out, address_names.entries[entry].name, ADDRESS_NAME_SIZE);
+    }
+    pthread_mutex_unlock(&name_lock);
+
+    if (entry < 0 && address_is_zero(address)) {
+        snprintf(out, ADDRESS_NAME_SIZE, "coinbase");
+    } else if (entry < 0) {
+        snprintf(out, ADDRESS_NAME_SIZE, "0x%02x%02x%02x%02x...",
+                 address->bytes[0], address->bytes[1], address->bytes[2], address->bytes[3]);
+    }
+}
+
+// The honest node with the most work behind its tip stands in for the network's balances
+Node* reference_node() {
+    Node* best = NULL;
+    for (int i = 0; i < num_nodes; i++) {
+        if (!network[i].is_malicious &&
+            (best == NULL || atomic_load(&network[i].tip_work) > atomic_load(&best->tip_work))) {
+            best = &network[i];
+        }
+    }
+    return best ? best : &network[0];
+}
+
+// Next nonce for a transaction from `sender`: one past the last this process signed for it, or
+// the account's nonce on the reference node's chain when that is further along, as after a restart
+uint64_t wallet_next_nonce(const Address* sender) {
+    StateSnapshot* state = chain_tip_state(&reference_node()->blockchain);
+    pthread_rwlock_rdlock(&accounts.lock);
+    long id = account_id(&accounts, sender);
+    pthread_rwlock_unlock(&accounts.lock);
+    uint64_t nonce = id >= 0 ? state_nonce(state, (size_t)id) : 0;
+    state_release(state);
+
+    pthread_mutex_lock(&name_lock);
+    long entry = address_index_find(&address_names.index, sender, address_names.entries, sizeof(AddressName));
+    if (entry >= 0) {
+        if (address_names.entries[entry].next_nonce > nonce) {
+            nonce = address_names.entries[entry].next_nonce;
+        }
+        address_names.entries[entry].next_nonce = nonce + 1;
+    }
+    pthread_mutex_unlock(&name_lock);
+    return nonce;
+}
+
+// Signs with the sender's key when this process holds it; otherwise the signature stays zero
+void sign_transaction(Transaction* tx) {
+    uint8_t seed[ED25519_SEED_SIZE];
+    pthread_mutex_lock(&name_lock);
+    long entry = address_names.entries
+        ? address_index_find(&address_names.index, &tx->sender, address_names.entries, sizeof(AddressName))
+        : -1;
+    if (entry >= 0) {
+        memcpy(seed, address_names.entries[entry].seed, ED25519_SEED_SIZE);
+    }
+    pthread_mutex_unlock(&name_lock);
+
+    memset(tx->signature, 0, SIGNATURE_SIZE);
+    if (entry >= 0) {
+        uint8_t body[TX_BODY_SIZE];
+        encode_transaction_body(tx, body);
+        ed25519_sign(seed, tx->sender.bytes, body, TX_BODY_SIZE, tx->signature);
+    }
+}
+
+// A transfer from a registered name, with the sender's next nonce; needs a running network
+Transaction make_transaction(const char* sender, const char* receiver, Amount amount, Amount fee) {
+    Transaction tx;
+    tx.sender = register_name(sender);
+    tx.receiver = register_name(receiver);
+    tx.amount = amount;
+    tx.fee = fee;
+    tx.nonce = wallet_next_nonce(&tx.sender);
+    tx.timestamp = sim_time();
+    sign_transaction(&tx);
+    return tx;
+}
+
+// First transaction of every mined block: pays the reward and the block's fees from the zero
+// address to the miner
+Transaction make_coinbase(const Address* miner, Amount fees) {
+    Transaction tx;
+    memset(&tx.sender, 0, sizeof(tx.sender));
+    tx.receiver = *miner;
+    tx.amount = REWARD_AMOUNT + fees;
+    tx.fee = 0;
+    tx.nonce = 0;
+    tx.timestamp = sim_time();
+    memset(tx.signature, 0, SIGNATURE_SIZE);
+    return tx;
+}
+
+void tx_queue_init(TxQueue* queue, size_t capacity) {
+    queue->slots = (TxQueueSlot*)malloc(sizeof(TxQueueSlot) * capacity);
+    queue->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&queue->slots[i].sequence, i);
+    }
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+}
+
+void tx_queue_free(TxQueue* queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+bool tx_queue_push(TxQueue* queue, const Transaction* tx) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    TxQueueSlot* slot;
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  // Full
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->tx = *tx;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+bool tx_queue_pop(TxQueue* queue, Transaction* out) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    TxQueueSlot* slot;
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  // Empty
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *out = slot->tx;
+    atomic_store_explicit(&slot->sequence, pos + queue->mask + 1, memory_order_release);
+    return true;
+}
+
+bool tx_queue_empty(TxQueue* queue) {
+    return atomic_load(&queue->dequeue_pos) == atomic_load(&queue->enqueue_pos);
+}
+
+void signature_cache_init(SignatureCache* cache, size_t slot_count) {
+    cache->slots = (uint8_t(*)[HASH_SIZE])calloc(slot_count, HASH_SIZE);
+    cache->mask = slot_count - 1;
+    pthread_rwlock_init(&cache->lock, NULL);
+}
+
+void signature_cache_free(SignatureCache* cache) {
+    free(cache->slots);
+    cache->slots = NULL;
+    pthread_rwlock_destroy(&cache->lock);
+}
+
+bool signature_cache_contains(SignatureCache* cache, const uint8_t leaf[HASH_SIZE]) {
+    pthread_rwlock_rdlock(&cache->lock);
+    bool found = memcmp(cache->slots[get_u64_le(leaf) & cache->mask], leaf, HASH_SIZE) == 0;
+    pthread_rwlock_unlock(&cache->lock);
+    return found;
+}
+
+void signature_cache_add(SignatureCache* cache, const uint8_t leaf[HASH_SIZE]) {
+    pthread_rwlock_wrlock(&cache->lock);
+    memcpy(cache->slots[get_u64_le(leaf) & cache->mask], leaf, HASH_SIZE);
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+// Checks the signatures of every transaction but coinbases as one batch, leaving out those whose
+// merkle leaf is in the signature cache when `leaves` has them. The caller holds the directory's
+// read lock; senders it knows come with their key already decoded.
+bool verify_transaction_signatures(const AccountDirectory* dir, const Transaction* txs,
+                                   const uint8_t (*leaves)[HASH_SIZE], int count) {
+    if (count <= 0) {
+        return true;
+    }
+    SignatureCheck* checks = (SignatureCheck*)malloc(sizeof(SignatureCheck) * (size_t)count);
+    uint8_t (*bodies)[TX_BODY_SIZE] = (uint8_t(*)[TX_BODY_SIZE])malloc((size_t)TX_BODY_SIZE * (size_t)count);
+    size_t n = 0;
+    bool valid = true;
+    for (int t = 0; t < count && valid; t++) {
+        const Transaction* tx = &txs[t];
+        if (address_is_zero(&tx->sender)) continue;
+        if (leaves != NULL && signature_cache_contains(&signature_cache, leaves[t])) continue;
+        long id = account_id(dir, &tx->sender);
+        if (id >= 0 && !dir->keys[id].valid) {
+            valid = false;
+            break;
+        }
+        encode_transaction_body(tx, bodies[n]);
+        checks[n].public_key = tx->sender.bytes;
+        checks[n].key = id >= 0 ? &dir->keys[id].point : NULL;
+        checks[n].message = bodies[n];
+        checks[n].message_len = TX_BODY_SIZE;
+        checks[n].signature = tx->signature;
+        n++;
+    }
+    valid = valid && ed25519_verify_batch(checks, n);
+    free(checks);
+    free(bodies);
+    return valid;
+}
+
+typedef struct {
+    const Transaction* txs;
+    int count;
+    TransactionVerdict* verdicts;
+} SignatureJob;
+
+// Each worker checks its slice as one batch, and one by one only when the batch fails, to find
+// the transactions that made it fail
+void verify_signatures_task(void* arg, int worker, int workers) {
+    SignatureJob* job = (SignatureJob*)arg;
+    int begin = (int)((long)job->count * worker / workers);
+    int end = (int)((long)job->count * (worker + 1) / workers);
+    if (verify_transaction_signatures(&accounts, job->txs + begin, NULL, end - begin)) {
+        return;
+    }
+    for (int t = begin; t < end; t++) {
+        if (!verify_transaction_signatures(&accounts, job->txs + t, NULL, 1)) {
+            job->verdicts[t] = TX_BAD_SIGNATURE;
+        }
+    }
+}
+
+// Checks a whole batch against a snapshot of the reference node's tip state, so the node
+// keeps accepting blocks while the batch is checked. Fills in where the sender of every
+// transaction that passes stands in that state, for the pool to check it against what the
+// sender already has pending.
+void validate_transactions(const Transaction* txs, int count, TransactionVerdict* verdicts, SenderState* senders) {
+    Node* node = reference_node();
+    StateSnapshot* state = chain_tip_state(&node->blockchain);
+    pthread_rwlock_rdlock(&accounts.lock);
+    for (int t = 0; t < count; t++) {
+        verdicts[t] = TX_VALID;
+    }
+    SignatureJob job = {txs, count, verdicts};
+    if (count >= PARALLEL_VALIDATION_THRESHOLD) {
+        worker_pool_run(&validation_pool, verify_signatures_task, &job);
+    } else {
+        verify_signatures_task(&job, 0, 1);
+    }
+    for (int t = 0; t < count; t++) {
+        if (verdicts[t] != TX_BAD_SIGNATURE) {
+            uint8_t leaf[HASH_SIZE];
+            merkle_leaf_hash(&txs[t], leaf);
+            signature_cache_add(&signature_cache, leaf);
+        }
+        if (verdicts[t] != TX_VALID) continue;
+
+        const Transaction* tx = &txs[t];
+        long sender = account_id(&accounts, &tx->sender);
+        Amount balance;
+        if (sender < 0 || !state_get(state, (size_t)sender, &balance)) {
+            verdicts[t] = TX_INSUFFICIENT_FUNDS;
+            continue;
+        }
+        uint64_t nonce = state_nonce(state, (size_t)sender);
+        Amount cost;
+        if (tx->amount <= 0 || tx->fee < 0 || !amount_add(tx->amount, tx->fee, &cost)) {
+            verdicts[t] = TX_BAD_AMOUNT;
+        } else if (tx->nonce < nonce) {
+            verdicts[t] = TX_STALE_NONCE;
+        } else if (tx->nonce - nonce >= MEMPOOL_MAX_NONCE_AHEAD) {
+            verdicts[t] = TX_NONCE_TOO_FAR;
+        } else if (balance < cost) {
+            verdicts[t] = TX_INSUFFICIENT_FUNDS;
+        }
+        senders[t].account = (size_t)sender;
+        senders[t].balance = balance;
+        senders[t].nonce = nonce;
+    }
+    pthread_rwlock_unlock(&accounts.lock);
+    state_release(state);
+}
+// Safe to call from any number of threads; validation happens later on the admission thread
+void add_transaction(Transaction tx) {
+    while (!tx_queue_push(&submission_queue, &tx)) {
+        sched_yield();  // Queue full: let the admission thread catch up
+    }
+
+    // Only pay for the wakeup when the admission thread is actually parked. The fence orders
+    // our push before the flag read, pairing with the flag store before the emptiness re-check.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&admission_waiting)) {
+        pthread_mutex_lock(&admission_lock);
+        pthread_cond_signal(&admission_cond);
+        pthread_mutex_unlock(&admission_lock);
+    }
+}
+
+void* admit_transactions(void* arg) {
+    (void)arg;
+    Transaction batch[ADMISSION_BATCH];
+    TransactionVerdict verdicts[ADMISSION_BATCH];
+    SenderState senders[ADMISSION_BATCH];
+
+    while (true) {
+        int count = 0;
+        while (count < ADMISSION_BATCH && tx_queue_pop(&submission_queue, &batch[count])) {
+            count++;
+        }
+
+        if (count == 0) {
+            if (!atomic_load(&admission_running)) break;
+
+            // Park until a producer signals; re-check emptiness after announcing we are waiting
+            pthread_mutex_lock(&admission_lock);
+            atomic_store(&admission_waiting, true);
+            while (tx_queue_empty(&submission_queue) && atomic_load(&admission_running)) {
+                pthread_cond_wait(&admission_cond, &admission_lock);
+            }
+            atomic_store(&admission_waiting, false);
+            pthread_mutex_unlock(&admission_lock);
+            continue;
+        }
+
+        validate_transactions(batch, count, verdicts, senders);
+
+        // The pool keeps accepting transactions while a block is being mined
+        pthread_mutex_lock(&transaction_lock);
+        for (int i = 0; i < count; i++) {
+            if (verdicts[i] == TX_VALID) {
+                verdicts[i] = mempool_add(&mempool, &batch[i], &senders[i]);
+            }
+        }
+        pthread_mutex_unlock(&transaction_lock);
+
+        for (int i = 0; i < count; i++) {
+            const Transaction* tx = &batch[i];
+            char sender[ADDRESS_NAME_SIZE];
+            char receiver[ADDRESS_NAME_SIZE];
+            format_address(&tx->sender, sender);
+            format_address(&tx->receiver, receiver);
+            char amount[AMOUNT_TEXT_SIZE];
+            char fee[AMOUNT_TEXT_SIZE];
+            format_amount(tx->amount, amount);
+            format_amount(tx->fee, fee);
+            switch (verdicts[i]) {
+            case TX_VALID:
+                printf("Added transaction: %s -> %s (%s, fee %s)\n", sender, receiver, amount, fee);
+                break;
+            case TX_REPLACED:
+                printf("Replaced transaction: %s -> %s (%s, fee %s) takes over %s's nonce %llu\n",
+                       sender, receiver, amount, fee, sender, (unsigned long long)tx->nonce);
+                break;
+            case TX_BAD_SIGNATURE:
+                printf("Invalid transaction: signature does not match %s\n", sender);
+                break;
+            case TX_BAD_AMOUNT:
+                printf("Invalid transaction: amount or fee out of range\n");
+                break;
+            case TX_INSUFFICIENT_FUNDS:
+                printf("Invalid transaction: %s doesn't have enough funds\n", sender);
+                break;
+            case TX_OVERSPENT:
+                printf("Invalid transaction: %s's pending transactions leave too little for it\n", sender);
+                break;
+            case TX_STALE_NONCE:
+                printf("Invalid transaction: %s already used nonce %llu\n", sender, (unsigned long long)tx->nonce);
+                break;
+            case TX_NONCE_TOO_FAR:
+                printf("Invalid transaction: nonce %llu is too far ahead of %s's\n", (unsigned long long)tx->nonce, sender);
+                break;
+            case TX_UNDERPRICED:
+                printf("Rejected transaction: %s's fee %s does not outbid the pool\n", sender, fee);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&admission_lock);
+        atomic_fetch_add(&admitted_count, (size_t)count);
+        pthread_cond_broadcast(&admitted_cond);
+        pthread_mutex_unlock(&admission_lock);
+    }
+
+    return NULL;
+}
+
+// Blocks until every transaction submitted before the call has been validated
+void wait_for_admission() {
+    size_t target = atomic_load(&submission_queue.enqueue_pos);
+    pthread_mutex_lock(&admission_lock);
+    while (atomic_load(&admitted_count) < target) {
+        pthread_cond_wait(&admitted_cond, &admission_lock);
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+// Add this function to display rewards
+void print_rewards() {
+    printf("\nMining Rewards Summary:\n");
+    Blockchain* chain = &reference_node()->blockchain;
+    Amount* rewards = (Amount*)calloc((size_t)num_nodes, sizeof(Amount));
+
+    // Coinbases on the reference node's best chain
+    pthread_mutex_lock(&chain->lock);
+    for (int h = chain->base > 1 ? chain->base : 1; h < chain->length; h++) {
+        const Transaction* coinbase = &chain_at(chain, h)->transactions[0];
+        for (int i = 0; i < num_nodes; i++) {
+            if (address_equal(&coinbase->receiver, &network[i].address)) {
+                rewards[i] += coinbase->amount;
+            }
+        }
+    }
+    int base = chain->base;
+    pthread_mutex_unlock(&chain->lock);
+
+    if (base > 1) {
+        printf("(counted from block %d, the checkpoint this node restarted from)\n", base);
+    }
+    Amount other = 0;
+    char text[AMOUNT_TEXT_SIZE];
+    for (int i = 0; i < num_nodes; i++) {
+        if (i < MAX_REPORTED_NODES) {
+            format_amount(rewards[i], text);
+            printf("Node %d received %s in rewards and fees\n", i, text);
+        } else {
+            other += rewards[i];
+        }
+    }
+    if (num_nodes > MAX_REPORTED_NODES) {
+        format_amount(other, text);
+        printf("%d more nodes received %s in rewards and fees\n", num_nodes - MAX_REPORTED_NODES, text);
+    }
+    free(rewards);
+}
+
+typedef enum {
+    BLOCK_VALID,
+    BLOCK_BAD_HASH,
+    BLOCK_BAD_POW,
+    BLOCK_DUPLICATE,
+    BLOCK_UNKNOWN_PARENT,
+    BLOCK_BAD_LINK,
+    BLOCK_PRUNED_PARENT,
+    BLOCK_BAD_MERKLE_ROOT,
+    BLOCK_BAD_COINBASE,
+    BLOCK_BAD_SIGNATURE,
+    BLOCK_BAD_NONCE,
+    BLOCK_BAD_TRANSACTION
+} BlockVerdict;
+
+const char* block_verdict_name(BlockVerdict verdict) {
+    switch (verdict) {
+        case BLOCK_VALID: return "valid";
+        case BLOCK_BAD_HASH: return "header hash mismatch";
+        case BLOCK_BAD_POW: return "proof of work below target";
+        case BLOCK_DUPLICATE: return "already known";
+        case BLOCK_UNKNOWN_PARENT: return "parent block unknown";
+        case BLOCK_BAD_LINK: return "height does not follow its parent";
+        case BLOCK_PRUNED_PARENT: return "forks below the kept state history";
+        case BLOCK_BAD_MERKLE_ROOT: return "transactions do not match the merkle root";
+        case BLOCK_BAD_COINBASE: return "invalid coinbase";
+        case BLOCK_BAD_SIGNATURE: return "transaction signature does not verify";
+        case BLOCK_BAD_NONCE: return "transaction nonce out of sequence";
+        case BLOCK_BAD_TRANSACTION: return "invalid transaction";
+    }
+    return "unknown";
+}
+
+typedef struct {
+    const Block* block;
+    MerkleTree* tree;
+    const AccountDirectory* accounts;
+    const StateSnapshot* state;   // NULL to skip the amount checks
+    atomic_bool bad_coinbase;
+    atomic_bool bad_signature;
+    atomic_bool bad_transaction;
+} TransactionValidation;
+
+// Each worker hashes the merkle leaves of its slice, batch-checks their signatures and checks
+// each transaction on its own; what depends on the transactions before it is left to
+// check_block_transfers. The caller holds the directory's read lock, so workers only read.
+void validate_transactions_task(void* arg, int worker, int workers) {
+    TransactionValidation* job = (TransactionValidation*)arg;
+    int count = job->block->tx_count;
+    int begin = (int)((long)count * worker / workers);
+    int end = (int)((long)count * (worker + 1) / workers);
+
+    for (int i = begin; i < end; i++) {
+        const Transaction* tx = &job->block->transactions[i];
+        merkle_leaf_hash(tx, job->tree->nodes[i]);
+
+        // Exactly one coinbase, first
+        if (i == 0 || address_is_zero(&tx->sender)) {
+            if (i != 0 || !address_is_zero(&tx->sender)) {
+                atomic_store_explicit(&job->bad_coinbase, true, memory_order_relaxed);
+            }
+            continue;
+        }
+        if (job->state != NULL && (tx->amount <= 0 || tx->fee < 0)) {
+            atomic_store_explicit(&job->bad_transaction, true, memory_order_relaxed);
+        }
+    }
+
+    const uint8_t (*leaves)[HASH_SIZE] = (const uint8_t(*)[HASH_SIZE])job->tree->nodes;
+    if (!verify_transaction_signatures(job->accounts, job->block->transactions + begin, leaves + begin, end - begin)) {
+        atomic_store_explicit(&job->bad_signature, true, memory_order_relaxed);
+    }
+}
+
+// Running position of one sender while a block's transfers are replayed
+typedef struct {
+    long account;        // -1 for an empty slot
+    uint64_t nonce;      // The next nonce it may use
+    Amount balance;      // What it has left
+} SenderTally;
+
+// Replays the block's transfers in order against the parent's state: every sender must be known,
+// use the nonces that follow its nonce in the state without a gap, and afford each amount and
+// fee; the coinbase must pay exactly the reward plus every fee, and no sum may overflow.
+// One pass with a small table of the block's senders. The caller holds the directory's read lock.
+BlockVerdict check_block_transfers(const AccountDirectory* dir, const Block* block, const StateSnapshot* state) {
+    size_t slots = 16;
+    while (slots < (size_t)block->tx_count * 2) slots *= 2;
+    SenderTally* tallies = (SenderTally*)malloc(sizeof(SenderTally) * slots);
+    for (size_t i = 0; i < slots; i++) {
+        tallies[i].account = -1;
+    }
+
+    BlockVerdict verdict = BLOCK_VALID;
+    Amount fees = 0;
+    for (int t = 1; t < block->tx_count && verdict == BLOCK_VALID; t++) {
+        const Transaction* tx = &block->transactions[t];
+        long account = account_id(dir, &tx->sender);
+        if (account < 0) {
+            verdict = BLOCK_BAD_TRANSACTION;
+            break;
+        }
+        size_t i = (size_t)account & (slots - 1);   // Ids are dense, so they spread on their own
+        while (tallies[i].account >= 0 && tallies[i].account != account) {
+            i = (i + 1) & (slots - 1);
+        }
+        SenderTally* tally = &tallies[i];
+        if (tally->account < 0) {
+            tally->account = account;
+            tally->nonce = state_nonce(state, (size_t)account);
+            if (!state_get(state, (size_t)account, &tally->balance)) {
+                verdict = BLOCK_BAD_TRANSACTION;
+                break;
+            }
+        }
+        Amount cost;
+        if (tx->nonce != tally->nonce) {
+            verdict = BLOCK_BAD_NONCE;
+        } else if (!amount_add(tx->amount, tx->fee, &cost) || tally->balance < cost || !amount_add(fees, tx->fee, &fees)) {
+            verdict = BLOCK_BAD_TRANSACTION;
+        } else {
+            tally->nonce++;
+            tally->balance -= cost;
+        }
+    }
+    free(tallies);
+
+    Amount reward;
+    if (verdict == BLOCK_VALID && (!amount_add(REWARD_AMOUNT, fees, &reward) || block->transactions[0].amount != reward)) {
+        verdict = BLOCK_BAD_COINBASE;
+    }
+    return verdict;
+}
+
+// Merkle root, coinbase and signatures, plus amounts, nonces and balances when `state` is the
+// parent's state. Needs no blockchain lock, so several blocks for the same node can be checked at once.
+BlockVerdict check_block_body(const Block* block, const StateSnapshot* state) {
+    if (block->tx_count < 1) {
+        return BLOCK_BAD_COINBASE;
+    }
+
+    MerkleTree tree;
+    merkle_init(&tree);
+    TransactionValidation job;
+    job.block = block;
+    job.tree = &tree;
+    job.accounts = &accounts;
+    job.state = state;
+    atomic_init(&job.bad_coinbase, false);
+    atomic_init(&job.bad_signature, false);
+    atomic_init(&job.bad_transaction, false);
+    merkle_reset(job.tree, block->tx_count);
+
+    pthread_rwlock_rdlock(&accounts.lock);
+    if (block->tx_count >= PARALLEL_VALIDATION_THRESHOLD) {
+        worker_pool_run(&validation_pool, validate_transactions_task, &job);
+    } else {
+        validate_transactions_task(&job, 0, 1);
+    }
+    BlockVerdict transfers = BLOCK_VALID;
+    if (state != NULL && !atomic_load(&job.bad_coinbase) && !atomic_load(&job.bad_transaction)) {
+        transfers = check_block_transfers(&accounts, block, state);
+    }
+    pthread_rwlock_unlock(&accounts.lock);
+
+    merkle_build_parents(job.tree);
+    uint8_t root[HASH_SIZE];
+    merkle_root(job.tree, root);
+    merkle_free(&tree);
+    if (memcmp(root, block->merkle_root, HASH_SIZE) != 0) {
+        return BLOCK_BAD_MERKLE_ROOT;
+    }
+    if (atomic_load(&job.bad_coinbase)) {
+        return BLOCK_BAD_COINBASE;
+    }
+    if (atomic_load(&job.bad_signature)) {
+        return BLOCK_BAD_SIGNATURE;
+    }
+    return atomic_load(&job.bad_transaction) ? BLOCK_BAD_TRANSACTION : transfers;
+}
+
+// Where the block would go in our tree: a new block whose parent we hold, one height above it
+BlockVerdict place_block(const Blockchain* chain, const Block* block, int* parent) {
+    if (chain_find(chain, block->hash) >= 0) {
+        return BLOCK_DUPLICATE;
+    }
+    *parent = chain_find(chain, block->previous_hash);
+    if (*parent < 0) {
+        return BLOCK_UNKNOWN_PARENT;
+    }
+    if (block->index != chain->entries[*parent].block->index + 1) {
+        return BLOCK_BAD_LINK;
+    }
+    if (chain->entries[*parent].state == NULL) {
+        return BLOCK_PRUNED_PARENT;
+    }
+    return BLOCK_VALID;
+}
+
+// Header hash and proof of work: everything that needs neither the tree nor a state
+BlockVerdict check_block_header(const Block* block) {
+    uint8_t hash[HASH_SIZE];
+    compute_block_hash(block, hash);
+    if (memcmp(hash, block->hash, HASH_SIZE) != 0) {
+        return BLOCK_BAD_HASH;
+    }
+    // The claimed difficulty comes from the sender, so it is bounded before it indexes the hash
+    if (block->difficulty_bits < (uint32_t)difficulty_bits || block->difficulty_bits > HASH_SIZE * 8 ||
+        !hash_meets_difficulty(block->hash, (int)block->difficulty_bits)) {
+        return BLOCK_BAD_POW;
+    }
+    return BLOCK_VALID;
+}
+
+// Points the best chain at entry `e`, whose branch has more work than the tip. Every block in the
+// tree already carries its own state, so only the heights above the fork point are rewritten.
+void reorganize(Node* node, int e) {
+    Blockchain* chain = &node->blockchain;
+    int fork = e;
+    int joined = 0;
+    while (!chain_is_active(chain, fork)) {
+        fork = chain->entries[fork].parent;
+        joined++;
+    }
+    int left = chain->length - chain->entries[fork].block->index - 1;
+    for (int height = chain->length - left; height < chain->length; height++) {
+        const Block* block = chain->entries[chain->active[height]].block;
+        if (block->tx_count > 0 && address_equal(&block->transactions[0].receiver, &node->address)) {
+            node->orphaned_blocks++;
+        }
+    }
+
+    for (int entry = e; entry != fork; entry = chain->entries[entry].parent) {
+        chain_set_active(chain, entry);
+    }
+    chain->length = chain->entries[e].block->index + 1;
+
+    node->reorgs++;
+    if (left > node->deepest_reorg) {
+        node->deepest_reorg = left;
+    }
+    node_printf("Node %d reorganized to block %d: %d blocks left the best chain, %d joined\n",
+          node->id, chain->entries[e].block->index, left, joined);
+}
+
+// Mirrors the tip entry into the node's atomics; called with the blockchain lock held
+void publish_tip(Node* node) {
+    atomic_store(&node->tip_work, chain_tip_entry(&node->blockchain)->work);
+}
+
+// Adds a block on top of the node's tip without checks, adopting the caller's reference to
+// the state it produces; used for genesis
+void add_block_to_chain(Node* node, const Block* block, StateSnapshot* state) {
+    pthread_mutex_lock(&node->blockchain.lock);
+    const TreeEntry* tip = chain_tip_entry(&node->blockchain);
+    int parent = tip ? node->blockchain.active[node->blockchain.length - 1] : -1;
+    int e = chain_add(&node->blockchain, block, parent, state);
+    chain_set_active(&node->blockchain, e);
+    publish_tip(node);
+    pthread_mutex_unlock(&node->blockchain.lock);
+}
 
+// The tip a checkpoint describes, captured under the blockchain lock and written after it is released
 typedef struct {
-    int id;
-    Blockchain blockchain;
-    pthread_t thread;
-    bool running;
-    double total_rewards;
-    bool is_malicious;
-} Node;
+    StateSnapshot* state;
+    int height;
+    uint64_t record;    // Of the tip block in the node's log
+    uint64_t work;
+    uint8_t hash[HASH_SIZE];
+} CheckpointTip;
 
-Account accounts[NUM_NODES];
-Transaction pending_transactions[TRANSACTIONS_PER_BLOCK];
-int pending_transaction_count = 0;
-pthread_mutex_t transaction_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t transaction_cond = PTHREAD_COND_INITIALIZER;
+// Fails when the tip is not in the log; called with the blockchain lock held
+bool capture_checkpoint(Node* node, CheckpointTip* tip) {
+    const TreeEntry* entry = chain_tip_entry(&node->blockchain);
+    const BlockLog* log = &node->log;
+    // The tip is almost always one of the last records, so search from the end
+    for (size_t n = log->count; n-- > 0;) {
+        if (memcmp(log->entries[n].hash, entry->block->hash, HASH_SIZE) == 0) {
+            tip->state = state_retain(entry->state);
+            tip->height = entry->block->index;
+            tip->record = n;
+            tip->work = entry->work;
+            memcpy(tip->hash, entry->block->hash, HASH_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
 
-Node network[NUM_NODES];
-bool mining = false;
-bool block_found = false;
-pthread_mutex_t mining_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t balance_lock = PTHREAD_MUTEX_INITIALIZER;
+// Checkpoint file: magic u32 | height u32 | log record u64 | cumulative work u64 | tip hash |
+// account count u64 | (address | balance i64 | nonce u64) per account | CRC-32 of all before it
+void encode_checkpoint(const AccountDirectory* dir, const CheckpointTip* tip, ByteBuffer* buf) {
+    uint8_t* header = byte_buffer_extend(buf, CHECKPOINT_HEADER_SIZE);
+    put_u32_le(header, CHECKPOINT_MAGIC);
+    put_u32_le(header + 4, (uint32_t)tip->height);
+    put_u64_le(header + 8, tip->record);
+    put_u64_le(header + 16, tip->work);
+    memcpy(header + 24, tip->hash, HASH_SIZE);
 
-void simple_hash(const char* str, char output[65]) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+    uint64_t account_count = 0;
+    for (size_t id = 0; id < dir->count; id++) {
+        Amount balance;
+        if (!state_get(tip->state, id, &balance)) continue;
+        memcpy(byte_buffer_extend(buf, ADDRESS_SIZE), dir->addresses[id].bytes, ADDRESS_SIZE);
+        buffer_put_u64(buf, (uint64_t)balance);
+        buffer_put_u64(buf, state_nonce(tip->state, id));
+        account_count++;
     }
-    snprintf(output, 65, "%016lx%016lx%016lx%016lx", hash, hash, hash, hash);
+    put_u64_le(buf->data + 24 + HASH_SIZE, account_count);
+    uint32_t crc = crc32(buf->data, buf->size);
+    put_u32_le(byte_buffer_extend(buf, 4), crc);
 }
 
-long calculate_next_proof(long last_proof) {
-    long proof = last_proof;
-    while (true) {
-        proof++;
-        if ((proof % 2 != 0) && (proof % 3 == 0)) {
-            return proof;
+// Replaces `checkpoint.dat` in the node's log directory through a temporary file, so a crash
+// leaves either the old checkpoint or the new one. Consumes the tip's state reference.
+void write_checkpoint(Node* node, CheckpointTip* tip) {
+    pthread_mutex_lock(&node->checkpoint_lock);
+    if (tip->height > node->checkpoint_height) {
+        ByteBuffer buf;
+        byte_buffer_init(&buf);
+        pthread_rwlock_rdlock(&accounts.lock);
+        encode_checkpoint(&accounts, tip, &buf);
+        pthread_rwlock_unlock(&accounts.lock);
+
+        char path[PATH_SIZE];
+        char temporary[PATH_SIZE];
+        snprintf(path, PATH_SIZE, "%s/checkpoint.dat", node->log.dir);
+        snprintf(temporary, PATH_SIZE, "%s/checkpoint.tmp", node->log.dir);
+        FILE* file = fopen(temporary, "wb");
+        bool written = file && fwrite(buf.data, 1, buf.size, file) == buf.size;
+        if (file && fclose(file) != 0) written = false;
+#ifdef _WIN32
+        if (written) remove(path);   // rename does not replace an existing file there
+#endif
+        if (written && rename(temporary, path) == 0) {
+            node->checkpoint_height = tip->height;
+            node_printf("Node %d checkpointed %zu bytes of state at height %d\n", node->id, buf.size, tip->height);
+        } else {
+            node_printf("Node %d could not write a checkpoint to %s\n", node->id, path);
         }
+        byte_buffer_free(&buf);
     }
+    pthread_mutex_unlock(&node->checkpoint_lock);
+    state_release(tip->state);
+    tip->state = NULL;
 }
 
-Block* create_genesis_block() {
-    Block* block = (Block*)malloc(sizeof(Block));
-    block->index = 0;
-    block->timestamp = time(NULL);
-    strcpy(block->previous_hash, "0");
-    block->next = NULL;
+// Roots the node's empty tree at the block its checkpoint describes, with the checkpointed
+// state. Fails, so the log is replayed from genesis, when there is no checkpoint or it is
+// damaged or names a block the log does not hold.
+bool load_checkpoint(Node* node, size_t* next_record) {
+    char path[PATH_SIZE];
+    snprintf(path, PATH_SIZE, "%s/checkpoint.dat", node->log.dir);
+    MappedFile map;
+    if (!map_file(path, &map)) {
+        return false;
+    }
+
+    const uint8_t* in = map.data;
+    bool valid = map.size >= CHECKPOINT_HEADER_SIZE + 4 &&
+                 crc32(in, map.size - 4) == get_u32_le(in + map.size - 4) &&
+                 get_u32_le(in) == CHECKPOINT_MAGIC;
+    uint64_t account_count = valid ? get_u64_le(in + 24 + HASH_SIZE) : 0;
+    uint64_t record = valid ? get_u64_le(in + 8) : 0;
+    valid = valid && map.size == CHECKPOINT_HEADER_SIZE + account_count * CHECKPOINT_ACCOUNT_SIZE + 4 &&
+            record < node->log.count && memcmp(node->log.entries[record].hash, in + 24, HASH_SIZE) == 0;
+    Block* block = valid ? block_log_read(&node->log, (size_t)record, &node->blocks) : NULL;
+    if (block == NULL || block->index != (int)get_u32_le(in + 4)) {
+        if (node->id < MAX_REPORTED_NODES) {
+            node_printf("Node %d ignores its checkpoint, which is damaged or does not match its block log\n", node->id);
+        }
+        unmap_file(&map);
+        return false;
+    }
 
-    // Initialize empty transactions
-    for (int i = 0; i < TRANSACTIONS_PER_BLOCK; i++) {
-        strcpy(block->transactions[i].sender, "");
-        strcpy(block->transactions[i].receiver, "");
-        block->transactions[i].amount = 0;
-        block->transactions[i].timestamp = 0;
+    StateSnapshot* state = state_create();
+    pthread_rwlock_wrlock(&accounts.lock);
+    for (uint64_t a = 0; a < account_count; a++) {
+        const uint8_t* account = in + CHECKPOINT_HEADER_SIZE + a * CHECKPOINT_ACCOUNT_SIZE;
+        Address address;
+        memcpy(address.bytes, account, ADDRESS_SIZE);
+        size_t id = account_id_or_create(&accounts, &address);
+        state_set(state, id, (Amount)get_u64_le(account + ADDRESS_SIZE));
+        state_set_nonce(state, id, get_u64_le(account + ADDRESS_SIZE + 8));
     }
+    pthread_rwlock_unlock(&accounts.lock);
 
-    char buffer[256];
-    snprintf(buffer, sizeof(buffer), "%d%ld%s",
-             block->index, block->timestamp, block->previous_hash);
-    simple_hash(buffer, block->hash);
+    Blockchain* chain = &node->blockchain;
+    pthread_mutex_lock(&chain->lock);
+    chain->base = block->index;
+    int e = chain_add(chain, block, -1, state);
+    chain->entries[e].work = get_u64_le(in + 16);
+    chain_set_active(chain, e);
+    publish_tip(node);
+    pthread_mutex_unlock(&chain->lock);
+    block_release(block);
 
-    return block;
+    node->checkpoint_height = block->index;
+    *next_record = (size_t)record + 1;
+    unmap_file(&map);
+    return true;
 }
 
-Block* create_block(int index, const char* previous_hash, Transaction txs[TRANSACTIONS_PER_BLOCK], long proof) {
-    Block* block = (Block*)malloc(sizeof(Block));
-    block->index = index;
-    block->timestamp = time(NULL);
-    memcpy(block->transactions, txs, sizeof(Transaction) * TRANSACTIONS_PER_BLOCK);
-    strcpy(block->previous_hash, previous_hash);
-    block->next = NULL;
+// Adds a block whose state is known to the tree, adopting the reference to `state`, and makes it
+// the tip if its branch now has the most work; called with the blockchain lock held
+bool insert_block(Node* node, const Block* block, int parent, StateSnapshot* state) {
+    Blockchain* chain = &node->blockchain;
+    int tip = chain->active[chain->length - 1];
+    int e = chain_add(chain, block, parent, state);
+    if (chain->entries[e].work <= chain->entries[tip].work) {
+        return false;
+    }
+    if (parent == tip) {
+        chain_set_active(chain, e);
+    } else {
+        reorganize(node, e);
+    }
+    publish_tip(node);
+    chain_prune_states(chain);
+    return true;
+}
+
+// Honest nodes run the validation pipeline; malicious nodes only need the parent to attach to.
+// The blockchain lock is held only to find the parent and to insert the result: the body is
+// checked and applied against a retained snapshot of the parent's state, so other blocks for
+// this node, its miner and admission all keep going meanwhile. An accepted block joins the
+// tree with its state, and its log when the node is persistent; such a node also checkpoints
+// its tip every CHECKPOINT_INTERVAL heights.
+BlockVerdict receive_block(Node* node, const Block* block, bool* tip_moved) {
+    Blockchain* chain = &node->blockchain;
+    *tip_moved = false;
 
-    char buffer[2048];
-    char tx_data[1024] = "";
-    for (int i = 0; i < TRANSACTIONS_PER_BLOCK; i++) {
-        char temp[128];
-        snprintf(temp, sizeof(temp), "%s%s%.2f",
-                txs[i].sender, txs[i].receiver, txs[i].amount);
-        strcat(tx_data, temp);
+    BlockVerdict verdict = node->is_malicious ? BLOCK_VALID : check_block_header(block);
+    int parent = -1;
+    StateSnapshot* parent_state = NULL;
+    CheckpointTip checkpoint;
+    bool checkpoint_due = false;
+    if (verdict == BLOCK_VALID) {
+        pthread_mutex_lock(&chain->lock);
+        verdict = place_block(chain, block, &parent);
+        if (verdict == BLOCK_VALID) {
+            parent_state = state_retain(chain->entries[parent].state);
+        }
+        pthread_mutex_unlock(&chain->lock);
+    }
+    if (verdict == BLOCK_VALID && !node->is_malicious) {
+        verdict = check_block_body(block, parent_state);
     }
 
-    snprintf(buffer, sizeof(buffer), "%d%ld%s%ld%s",
-             block->index, block->timestamp, block->previous_hash, proof, tx_data);
-    simple_hash(buffer, block->hash);
+    if (verdict == BLOCK_VALID) {
+        StateSnapshot* state = state_apply_block(&accounts, parent_state, block);
+        pthread_mutex_lock(&chain->lock);
+        if (chain_find(chain, block->hash) >= 0) {
+            verdict = BLOCK_DUPLICATE;  // Another broadcast delivered it while we were checking
+            state_release(state);
+        } else {
+            *tip_moved = insert_block(node, block, parent, state);
+            if (block_log_enabled(&node->log)) {
+                if (!block_log_append(&node->log, block)) {
+                    node_printf("Node %d could not write block %d to its log\n", node->id, block->index);
+                } else if (*tip_moved && block->index % CHECKPOINT_INTERVAL == 0) {
+                    checkpoint_due = capture_checkpoint(node, &checkpoint);
+                }
+            }
+        }
+        pthread_mutex_unlock(&chain->lock);
+    }
+    state_release(parent_state);
+    if (checkpoint_due) {
+        write_checkpoint(node, &checkpoint);
+    }
 
-    return block;
+    // A missing parent or a block that came twice is the network's doing, not the sender's
+    if (verdict != BLOCK_VALID && verdict != BLOCK_UNKNOWN_PARENT && verdict != BLOCK_DUPLICATE) {
+        node_printf("Node %d rejected block %d: %s\n", node->id, block->index, block_verdict_name(verdict));
+    }
+    return verdict;
 }
 
-bool validate_transaction(Transaction tx) {
-    pthread_mutex_lock(&balance_lock);
-    bool valid = false;
-    for (int i = 0; i < NUM_NODES; i++) {
-        if (strcmp(accounts[i].address, tx.sender) == 0) {
-            valid = (accounts[i].balance >= tx.amount);
+// Rebuilds the block tree from the node's log: from its checkpoint when it has a usable one,
+// otherwise from genesis with `genesis_state`, which is adopted either way. Records were
+// validated before they were written, so they are only checked for integrity and applied;
+// the log is cut at the first damaged one, and a block whose parent is below the checkpoint
+// stays in the log but not in the tree. Returns whether the node has a chain.
+bool restore_chain(Node* node, StateSnapshot* genesis_state) {
+    Blockchain* chain = &node->blockchain;
+    BlockLog* log = &node->log;
+    size_t first = 0;
+    bool from_checkpoint = log->count > 0 && load_checkpoint(node, &first);
+    if (from_checkpoint) {
+        state_release(genesis_state);
+    }
+
+    size_t n = first;
+    for (; n < log->count; n++) {
+        Block* block = block_log_read(log, n, &node->blocks);
+        if (block == NULL) {
             break;
         }
+        if (n == 0) {
+            add_block_to_chain(node, block, genesis_state);
+            block_release(block);
+            continue;
+        }
+
+        pthread_mutex_lock(&chain->lock);
+        int parent = -1;
+        if (place_block(chain, block, &parent) == BLOCK_VALID) {
+            insert_block(node, block, parent, state_apply_block(&accounts, chain->entries[parent].state, block));
+        }
+        pthread_mutex_unlock(&chain->lock);
+        block_release(block);
     }
-    pthread_mutex_unlock(&balance_lock);
-    return valid;
+
+    bool reported = node->id < MAX_REPORTED_NODES;
+    if (n < log->count) {
+        if (reported) {
+            node_printf("Node %d: block log record %zu is damaged, dropping it and the %zu after it\n",
+                        node->id, n, log->count - n - 1);
+        }
+        block_log_truncate(log, n);
+    }
+    if (from_checkpoint) {
+        if (reported) {
+            node_printf("Node %d restored its checkpoint at height %d and replayed %zu later blocks, tip at height %d\n",
+                        node->id, chain->base, n - first, chain->length - 1);
+        }
+    } else if (n > 0) {
+        if (reported) {
+            node_printf("Node %d replayed %zu blocks from its log, tip at height %d\n", node->id, n, chain->length - 1);
+        }
+    } else {
+        state_release(genesis_state);
+    }
+    return from_checkpoint || n > 0;
 }
 
-void add_transaction(Transaction tx) {
-    pthread_mutex_lock(&transaction_lock);
+// xorshift64* over the node's own stream, so its decisions follow from the seed whichever
+// worker runs it and whatever the other nodes draw
+uint64_t node_random_bits(Node* node) {
+    node->rng ^= node->rng >> 12;
+    node->rng ^= node->rng << 25;
+    node->rng ^= node->rng >> 27;
+    return node->rng * 0x2545F4914F6CDD1DULL;
+}
 
-    if (pending_transaction_count < TRANSACTIONS_PER_BLOCK) {
-        if (validate_transaction(tx)) {
-            pending_transactions[pending_transaction_count++] = tx;
-            printf("Added transaction: %s -> %s (%.2f)\n", tx.sender, tx.receiver, tx.amount);
+// Uniform in [0, 1)
+double node_random(Node* node) {
+    return (double)(node_random_bits(node) >> 11) / 9007199254740992.0;
+}
 
-            if (pending_transaction_count == TRANSACTIONS_PER_BLOCK) {
-                mining = true;
-                block_found = false;
-                pthread_cond_broadcast(&transaction_cond);
-            }
+// Waiting time of a memoryless process with the given mean
+double node_exponential(Node* node, double mean) {
+    return -mean * log(1.0 - node_random(node));
+}
+
+bool event_before(const Event* a, const Event* b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+void event_queue_append(EventQueue* queue, const Event* event) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 16;
+        queue->heap = (Event*)realloc(queue->heap, sizeof(Event) * queue->capacity);
+    }
+    queue->heap[queue->count++] = *event;
+}
+
+void event_queue_push(EventQueue* queue, const Event* event) {
+    event_queue_append(queue, event);
+    size_t i = queue->count - 1;
+    Event item = *event;
+    while (i > 0 && event_before(&item, &queue->heap[(i - 1) / 2])) {
+        queue->heap[i] = queue->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->heap[i] = item;
+}
+
+Event event_queue_pop(EventQueue* queue) {
+    Event top = queue->heap[0];
+    Event last = queue->heap[--queue->count];
+    size_t i = 0;
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->count) break;
+        if (child + 1 < queue->count && event_before(&queue->heap[child + 1], &queue->heap[child])) child++;
+        if (!event_before(&queue->heap[child], &last)) break;
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    if (queue->count > 0) queue->heap[i] = last;
+    return top;
+}
+
+void message_free(Message* msg) {
+    if (msg->block) block_release(msg->block);
+    free(msg);
+}
+
+// Drops the queued events with their messages
+void event_queue_free(EventQueue* queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        if (queue->heap[i].msg) message_free(queue->heap[i].msg);
+    }
+    free(queue->heap);
+    queue->heap = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+// Queues a copy of `event`, which must not be due before the current simulated time. A node
+// running in a round keeps its own events that fall within the round and holds everything
+// else back until the round ends.
+void schedule_event(const Event* event) {
+    Event item = *event;
+    Node* node = current_node;
+    if (node) {
+        if (item.node == node->id && item.at < scheduler.round_end) {
+            item.seq = node->next_seq++;
+            event_queue_push(&node->mailbox, &item);
         } else {
-            printf("Invalid transaction: %s doesn't have enough funds\n", tx.sender);
+            event_queue_append(&node->outbox, &item);
         }
-    } else {
-        printf("Transaction pool is full. Waiting for block to be mined.\n");
+        return;
     }
+    item.seq = scheduler.next_seq++;
+    event_queue_push(item.type == EVENT_TRANSACTION ? &scheduler.arrivals : &scheduler.events, &item);
+}
 
-    pthread_mutex_unlock(&transaction_lock);
+// Starts simulated time over at 0
+void scheduler_init() {
+    memset(&scheduler, 0, sizeof(scheduler));
 }
-void update_balances(Transaction txs[TRANSACTIONS_PER_BLOCK], int miner_id) {
-    pthread_mutex_lock(&balance_lock);
 
-    // Update balances from transactions
-    for (int i = 0; i < TRANSACTIONS_PER_BLOCK; i++) {
-        Transaction tx = txs[i];
-        if (strlen(tx.sender) == 0) continue;
+// Events still pending are discarded
+void scheduler_free() {
+    event_queue_free(&scheduler.events);
+    event_queue_free(&scheduler.arrivals);
+}
 
-        for (int j = 0; j < NUM_NODES; j++) {
-            if (strcmp(accounts[j].address, tx.sender) == 0) {
-                accounts[j].balance -= tx.amount;
-            }
-            if (strcmp(accounts[j].address, tx.receiver) == 0) {
-                accounts[j].balance += tx.amount;
+// Bytes the message occupies on the wire
+size_t message_size(const Message* msg) {
+    if (msg->type == MESSAGE_GET_BLOCK) {
+        return MESSAGE_HEADER_SIZE + HASH_SIZE;
+    }
+    return MESSAGE_HEADER_SIZE + BLOCK_HEADER_SIZE + 4 + (size_t)msg->block->tx_count * TX_ENCODED_SIZE;
+}
+
+// Slot holding `to`, or the empty slot where it belongs
+size_t link_slot(const LinkTable* table, int to) {
+    size_t mask = table->capacity - 1;
+    size_t i = (size_t)(((uint64_t)(uint32_t)to * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (table->slots[i].to != -1 && table->slots[i].to != to) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The link from `node` to `to`, created from the defaults the first time it is used, so a
+// node only pays for the peers it has talked to
+Link* node_link(Node* node, int to) {
+    LinkTable* table = &node->links;
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        LinkTable grown;
+        grown.capacity = table->capacity ? table->capacity * 2 : 16;
+        grown.count = table->count;
+        grown.slots = (LinkSlot*)malloc(sizeof(LinkSlot) * grown.capacity);
+        for (size_t i = 0; i < grown.capacity; i++) {
+            grown.slots[i].to = -1;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->slots[i].to != -1) {
+                grown.slots[link_slot(&grown, table->slots[i].to)] = table->slots[i];
             }
         }
+        free(table->slots);
+        *table = grown;
+    }
+    LinkSlot* slot = &table->slots[link_slot(table, to)];
+    if (slot->to == -1) {
+        slot->to = to;
+        slot->link = transport.defaults;
+        table->count++;
+    }
+    return &slot->link;
+}
+
+void link_table_free(LinkTable* table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+// Configures one direction of a link; takes effect for messages sent afterwards. Call it
+// between runs, not from a node.
+void configure_link(int from, int to, double latency_ms, double bandwidth, double drop_rate) {
+    Link* link = node_link(&network[from], to);
+    link->latency_ms = latency_ms;
+    link->bandwidth = bandwidth;
+    link->drop_rate = drop_rate;
+    if (latency_ms < transport.lookahead_ms) {
+        transport.lookahead_ms = latency_ms;
     }
+}
 
-    // Add mining reward
-    if (miner_id >= 0 && miner_id < NUM_NODES) {
-        accounts[miner_id].balance += REWARD_AMOUNT;
-        network[miner_id].total_rewards += REWARD_AMOUNT;  // Track the reward
-        printf("Node %d received mining reward (%.2f)\n", miner_id, REWARD_AMOUNT);
+// Schedules a message's delivery over its link, taking ownership of it. A dropped message
+// still uses the link's bandwidth, as a lost packet would.
+void send_message(Message* msg) {
+    Node* sender = &network[msg->from];
+    size_t size = message_size(msg);
+    Link* link = node_link(sender, msg->to);
+    double now = sim_now_ms();
+    double start = link->busy_until > now ? link->busy_until : now;
+    link->busy_until = start + (double)size * 1000.0 / link->bandwidth;
+    msg->sent_at = now;
+    msg->deliver_at = link->busy_until + link->latency_ms;
+    sender->traffic.sent++;
+    sender->traffic.bytes += size;
+
+    if (node_random(sender) < link->drop_rate) {
+        sender->traffic.dropped++;
+        message_free(msg);
+        return;
     }
+    Event event;
+    memset(&event, 0, sizeof(event));
+    event.at = msg->deliver_at;
+    event.type = EVENT_DELIVERY;
+    event.node = msg->to;
+    event.msg = msg;
+    schedule_event(&event);
+}
 
-    pthread_mutex_unlock(&balance_lock);
+void send_block(int from, int to, const Block* block) {
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    msg->type = MESSAGE_BLOCK;
+    msg->from = from;
+    msg->to = to;
+    msg->block = block_retain(block);
+    send_message(msg);
 }
 
-// Add this function to display rewards
-void print_rewards() {
-    printf("\nMining Rewards Summary:\n");
-    for (int i = 0; i < NUM_NODES; i++) {
-        printf("Node %d received %.2f in mining rewards\n", i, network[i].total_rewards);
+void send_get_block(int from, int to, const uint8_t hash[HASH_SIZE]) {
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    msg->type = MESSAGE_GET_BLOCK;
+    msg->from = from;
+    msg->to = to;
+    memcpy(msg->hash, hash, HASH_SIZE);
+    send_message(msg);
+}
+
+void transport_init() {
+    transport.defaults.latency_ms = LINK_LATENCY_MS;
+    transport.defaults.bandwidth = LINK_BANDWIDTH;
+    transport.defaults.drop_rate = LINK_DROP_RATE;
+    transport.defaults.busy_until = 0.0;
+    transport.lookahead_ms = LINK_LATENCY_MS;
+}
+
+void print_transport_stats() {
+    Traffic total;
+    memset(&total, 0, sizeof(total));
+    size_t links = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        total.sent += network[i].traffic.sent;
+        total.dropped += network[i].traffic.dropped;
+        total.delivered += network[i].traffic.delivered;
+        total.bytes += network[i].traffic.bytes;
+        total.total_delay_ms += network[i].traffic.total_delay_ms;
+        links += network[i].links.count;
     }
+    printf("Transport: %llu messages sent, %llu dropped, %llu delivered, %llu bytes, mean delay %.1f ms over %zu links\n",
+          (unsigned long long)total.sent, (unsigned long long)total.dropped,
+          (unsigned long long)total.delivered, (unsigned long long)total.bytes,
+          total.delivered ? total.total_delay_ms / (double)total.delivered : 0.0, links);
 }
 
+int compare_state_pointers(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(StateSnapshot* const*)a;
+    uintptr_t y = (uintptr_t)*(StateSnapshot* const*)b;
+    return (x > y) - (x < y);
+}
 
-void add_block_to_chain(Node* node, Block* block, long proof) {
-    pthread_mutex_lock(&node->blockchain.lock);
+// Forgets the transactions whose nonce every node's best chain has used MEMPOOL_CONFIRMATIONS
+// blocks deep, including any a competing transaction with the same nonce made obsolete.
+// Between rounds, while no chain is changing. Nodes mostly share their confirmed block, so
+// only the few distinct states among them are read.
+void forget_confirmed_transactions() {
+    StateSnapshot** states = (StateSnapshot**)malloc(sizeof(StateSnapshot*) * (size_t)num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        Blockchain* chain = &network[i].blockchain;
+        pthread_mutex_lock(&chain->lock);
+        int height = chain->length - 1 - MEMPOOL_CONFIRMATIONS;
+        states[i] = state_retain(chain->entries[chain->active[height > chain->base ? height : chain->base]].state);
+        pthread_mutex_unlock(&chain->lock);
+    }
+    qsort(states, (size_t)num_nodes, sizeof(StateSnapshot*), compare_state_pointers);
+    int distinct = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (distinct == 0 || states[i] != states[distinct - 1]) {
+            states[distinct++] = states[i];
+        } else {
+            state_release(states[i]);
+        }
+    }
 
-    if (node->blockchain.head == NULL) {
-        node->blockchain.head = block;
-        node->blockchain.tail = block;
-    } else {
-        node->blockchain.tail->next = block;
-        node->blockchain.tail = block;
+    pthread_mutex_lock(&transaction_lock);
+    for (uint32_t account = 0; account < mempool.sender_count; account++) {
+        if (mempool.senders[account].count == 0) continue;
+        uint64_t confirmed = UINT64_MAX;
+        for (int i = 0; i < distinct; i++) {
+            uint64_t nonce = state_nonce(states[i], account);
+            if (nonce < confirmed) confirmed = nonce;
+        }
+        mempool_drop_below(&mempool, account, confirmed);
     }
-    node->blockchain.length++;
-    node->blockchain.current_proof = proof;
+    pthread_mutex_unlock(&transaction_lock);
+
+    for (int i = 0; i < distinct; i++) {
+        state_release(states[i]);
+    }
+    free(states);
+}
 
+// Builds a candidate on this node's own tip from the best-paying transactions that can follow
+// its state, unless one is already being mined or too few of them are pending. Finding a nonce is modelled
+// as a memoryless search at the node's share of SIM_HASH_RATE, so the completion is scheduled
+// an exponential delay ahead; a block that moves the tip before then abandons the candidate.
+void start_mining(Node* node) {
+    if (node->mining || node->skipping) return;
+
+    uint8_t prev_hash[HASH_SIZE];
+    pthread_mutex_lock(&node->blockchain.lock);
+    const TreeEntry* tip = chain_tip_entry(&node->blockchain);
+    int index = tip->block->index + 1;
+    StateSnapshot* state = state_retain(tip->state);
+    memcpy(prev_hash, tip->block->hash, HASH_SIZE);
     pthread_mutex_unlock(&node->blockchain.lock);
+
+    // The block is decided now, from whatever is pending when this miner starts
+    int limit = block_transaction_limit();
+    uint32_t* selected = (uint32_t*)malloc(sizeof(uint32_t) * (size_t)(limit > 0 ? limit : 1));
+    pthread_mutex_lock(&transaction_lock);
+    int tx_count = mempool.count >= MIN_BLOCK_TRANSACTIONS ? mempool_select(&mempool, state, limit, selected) : 0;
+    state_release(state);
+    if (tx_count < MIN_BLOCK_TRANSACTIONS) {
+        pthread_mutex_unlock(&transaction_lock);
+        free(selected);
+        return;
+    }
+
+    // For malicious nodes (Part 3), sometimes skip mining
+    if (node->is_malicious && node_random(node) < 0.5) {
+        pthread_mutex_unlock(&transaction_lock);
+        free(selected);
+        if (node->id < MAX_REPORTED_NODES) {
+            node_printf("Malicious node %d skipping mining round\n", node->id);
+        }
+        node->skipping = true;
+        return;
+    }
+
+    Block* new_block = create_block(node, index, prev_hash, tx_count + 1);
+    Amount fees = 0;   // Within the money supply, since every sender could afford its fees
+    for (int i = 0; i < tx_count; i++) {
+        new_block->transactions[i + 1] = mempool.entries[selected[i]].tx;
+        fees += new_block->transactions[i + 1].fee;
+    }
+    pthread_mutex_unlock(&transaction_lock);
+    free(selected);
+    new_block->transactions[0] = make_coinbase(&node->address, fees);
+
+    compute_merkle_root(new_block, &node->merkle);
+    node->mining = true;
+
+    Event event;
+    memset(&event, 0, sizeof(event));
+    double mean_ms = ldexp(1.0, (int)new_block->difficulty_bits) / (SIM_HASH_RATE / num_nodes) * 1000.0;
+    event.at = sim_now_ms() + node_exponential(node, mean_ms);
+    event.type = EVENT_BLOCK_FOUND;
+    event.node = node->id;
+    event.generation = node->mining_generation;
+    schedule_event(&event);
 }
 
-void broadcast_block(Block* block, long proof, int miner_id) {
-    // Update balances only once
-    if (block->index > 0) {
-        update_balances(block->transactions, miner_id);
+// A node whose tip moved abandons its candidate, and a malicious node sitting the round out
+// rejoins, both starting over on the new tip. The pool is pruned once the round ends.
+void announce_tip(Node* node, bool tip_moved) {
+    if (!tip_moved) return;
+    node->tip_moved = true;
+    if (node->mining) {
+        node->mining = false;
+        node->mining_generation++;
+        node->stale_candidates++;
     }
+    node->skipping = false;
+    start_mining(node);
+}
 
-    // Create a copy of the block for each node
-    for (int i = 0; i < NUM_NODES; i++) {
-        Block* block_copy = (Block*)malloc(sizeof(Block));
-        memcpy(block_copy, block, sizeof(Block));
-        block_copy->next = NULL;
-        add_block_to_chain(&network[i], block_copy, proof);
+// Holds a block whose parent we lack, evicting the oldest when full
+void orphan_add(Node* node, const Block* block) {
+    for (int i = 0; i < node->orphan_count; i++) {
+        if (memcmp(node->orphans[i]->hash, block->hash, HASH_SIZE) == 0) return;
     }
+    if (node->orphan_count == MAX_ORPHAN_BLOCKS) {
+        block_release(node->orphans[0]);
+        memmove(node->orphans, node->orphans + 1, sizeof(const Block*) * (MAX_ORPHAN_BLOCKS - 1));
+        node->orphan_count--;
+    }
+    node->orphans[node->orphan_count++] = block_retain(block);
 }
 
-void* mine_block(void* arg) {
-    Node* node = (Node*)arg;
+// Takes out an orphan whose parent is `hash`, handing over its reference; NULL if none
+const Block* orphan_take_child(Node* node, const uint8_t hash[HASH_SIZE]) {
+    for (int i = 0; i < node->orphan_count; i++) {
+        const Block* block = node->orphans[i];
+        if (memcmp(block->previous_hash, hash, HASH_SIZE) == 0) {
+            memmove(node->orphans + i, node->orphans + i + 1, sizeof(const Block*) * (size_t)(node->orphan_count - i - 1));
+            node->orphan_count--;
+            return block;
+        }
+    }
+    return NULL;
+}
 
-    while (node->running) {
-        pthread_mutex_lock(&transaction_lock);
-        while (!mining && node->running) {
-            pthread_cond_wait(&transaction_cond, &transaction_lock);
+// A block arriving from `from`. One whose parent we lack is held back while the parent is
+// fetched from the same peer; an accepted block releases any orphans waiting on it.
+void handle_block(Node* node, const Block* block, int from) {
+    block_retain(block);
+    while (block) {
+        bool moved;
+        BlockVerdict verdict = receive_block(node, block, &moved);
+        if (verdict == BLOCK_UNKNOWN_PARENT) {
+            orphan_add(node, block);
+            send_get_block(node->id, from, block->previous_hash);
+        }
+        if (verdict == BLOCK_VALID) {
+            announce_tip(node, moved);
         }
 
-        if (!node->running) {
-            pthread_mutex_unlock(&transaction_lock);
-            break;
+        const Block* child = verdict == BLOCK_VALID ? orphan_take_child(node, block->hash) : NULL;
+        block_release(block);
+        block = child;
+    }
+}
+
+void handle_get_block(Node* node, const uint8_t hash[HASH_SIZE], int from) {
+    Blockchain* chain = &node->blockchain;
+    const Block* block = NULL;
+    pthread_mutex_lock(&chain->lock);
+    int e = chain_find(chain, hash);
+    if (e >= 0) {
+        block = block_retain(chain->entries[e].block);
+    }
+    pthread_mutex_unlock(&chain->lock);
+    if (block) {
+        send_block(node->id, from, block);
+        block_release(block);
+    }
+}
+
+// The miner takes its own block first, then sends it to every other node over its links
+void broadcast_block(Node* miner, const Block* block) {
+    bool moved;
+    if (receive_block(miner, block, &moved) == BLOCK_VALID) {
+        announce_tip(miner, moved);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        if (i != miner->id) {
+            send_block(miner->id, i, block);
         }
+    }
+}
 
-        Transaction current_txs[TRANSACTIONS_PER_BLOCK];
-        memcpy(current_txs, pending_transactions, sizeof(Transaction) * TRANSACTIONS_PER_BLOCK);
-        pthread_mutex_unlock(&transaction_lock);
+// The scheduled end of a candidate's search. The nonce is found now, for real, so the block
+// carries valid proof of work; the search starts from a seeded position, so it is reproducible.
+void complete_mining(Node* node, unsigned generation) {
+    if (!node->mining || generation != node->mining_generation) {
+        return;   // Abandoned when the tip moved
+    }
+    node->mining = false;
 
-        bool found = false;
+    Block* new_block = node->candidate;
+    mine_nonce(node, new_block, node_random_bits(node));
 
-        pthread_mutex_lock(&mining_lock);
-        while (!found && !block_found && node->running) {
-            // For malicious nodes (Part 3), sometimes skip mining
-            if (node->is_malicious && rand() % 2 == 0) {
-                printf("Malicious node %d skipping mining round\n", node->id);
-                break;
-            }
+    // Malicious nodes might tamper with the block (Part 3)
+    if (node->is_malicious && node_random(node) < 0.5) {
+        node_printf("Malicious node %d tampering with block!\n", node->id);
+        new_block->transactions[1].amount *= 2; // Double the first transaction after the coinbase
+    }
+
+    node_printf("\nNode %d mined block %d with %d transactions, nonce %llu at %.3fs\n",
+          node->id, new_block->index, new_block->tx_count, (unsigned long long)new_block->nonce,
+          sim_now_ms() / 1000.0);
 
-            // Get the last proof from this node's blockchain
-            pthread_mutex_lock(&node->blockchain.lock);
-            long last_proof = node->blockchain.current_proof;
-            pthread_mutex_unlock(&node->blockchain.lock);
+    Block* published = publish_block(node, new_block);
+    broadcast_block(node, published);
+    block_release(published);
 
-            long proof = calculate_next_proof(last_proof);
+    // A rejected block leaves the tip where it was, with the same transactions still pending
+    start_mining(node);
+}
 
-            found = true;
-            if (!block_found) {
-                block_found = true;
+void dispatch_event(const Event* event) {
+    switch (event->type) {
+    case EVENT_TRANSACTION:
+        break;   // run_until admits arrivals itself, a timestamp's worth at a time
+    case EVENT_DELIVERY: {
+        Message* msg = event->msg;
+        Node* node = &network[msg->to];
+        node->traffic.delivered++;
+        node->traffic.total_delay_ms += msg->deliver_at - msg->sent_at;
+        if (msg->type == MESSAGE_BLOCK) {
+            handle_block(node, msg->block, msg->from);
+        } else {
+            handle_get_block(node, msg->hash, msg->from);
+        }
+        message_free(msg);
+        break;
+    }
+    case EVENT_BLOCK_FOUND:
+        complete_mining(&network[event->node], event->generation);
+        break;
+    }
+}
 
-                char prev_hash[65];
-                if (node->blockchain.tail) {
-                    strcpy(prev_hash, node->blockchain.tail->hash);
-                } else {
-                    strcpy(prev_hash, "0");
-                }
+// Runs the node's events of the current round in order, as a task on whichever thread picks it
+// up; returns how many there were
+uint64_t run_node(Node* node) {
+    uint64_t count = 0;
+    current_node = node;
+    while (node->mailbox.count > 0) {
+        Event event = event_queue_pop(&node->mailbox);
+        node->now_ms = event.at;
+        dispatch_event(&event);
+        count++;
+    }
+    current_node = NULL;
+    return count;
+}
 
-                Block* new_block = create_block(node->blockchain.length, prev_hash, current_txs, proof);
+typedef struct {
+    Node** nodes;
+    size_t count;
+    atomic_size_t next;
+    atomic_uint_fast64_t processed;
+} Round;
 
-                // Malicious nodes might tamper with the block (Part 3)
-                if (node->is_malicious && rand() % 2 == 0) {
-                    printf("Malicious node %d tampering with block!\n", node->id);
-                    new_block->transactions[0].amount *= 2; // Double the first transaction
-                }
+// Workers take the round's nodes one at a time, so a node with many events does not hold up
+// the ones queued behind a single worker
+void run_round_task(void* arg, int worker, int workers) {
+    (void)worker;
+    (void)workers;
+    Round* round = (Round*)arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&round->next, 1)) < round->count) {
+        atomic_fetch_add(&round->processed, run_node(round->nodes[i]));
+    }
+}
+
+int compare_node_ids(const void* a, const void* b) {
+    int x = (*(Node* const*)a)->id;
+    int y = (*(Node* const*)b)->id;
+    return (x > y) - (x < y);
+}
 
-                printf("\nNode %d mined block %d with proof %ld\n",
-                      node->id, new_block->index, proof);
+// Runs the node events due from the earliest one until `round_end`, then merges what the
+// nodes scheduled and prints what they reported, in node order
+void run_round(double round_end, Node** active) {
+    scheduler.round_end = round_end;
+    size_t count = 0;
+    while (scheduler.events.count > 0 && scheduler.events.heap[0].at < round_end) {
+        Event event = event_queue_pop(&scheduler.events);
+        Node* node = &network[event.node];
+        if (node->mailbox.count == 0) {
+            active[count++] = node;
+        }
+        event_queue_push(&node->mailbox, &event);
+    }
+    qsort(active, count, sizeof(Node*), compare_node_ids);
+    for (size_t i = 0; i < count; i++) {
+        active[i]->next_seq = scheduler.next_seq;
+        active[i]->tip_moved = false;
+    }
+
+    if (count == 1) {
+        scheduler.processed += run_node(active[0]);
+    } else {
+        Round round;
+        round.nodes = active;
+        round.count = count;
+        atomic_init(&round.next, 0);
+        atomic_init(&round.processed, 0);
+        worker_pool_run(&node_pool, run_round_task, &round);
+        scheduler.processed += atomic_load(&round.processed);
+    }
 
-                broadcast_block(new_block, proof, node->id);
-                free(new_block);
+    bool tip_moved = false;
+    for (size_t i = 0; i < count; i++) {
+        Node* node = active[i];
+        for (size_t j = 0; j < node->outbox.count; j++) {
+            Event* event = &node->outbox.heap[j];
+            event->seq = scheduler.next_seq++;
+            event_queue_push(&scheduler.events, event);
+        }
+        node->outbox.count = 0;
+        if (node->output.size > 0) {
+            fwrite(node->output.data, 1, node->output.size, stdout);
+            node->output.size = 0;
+        }
+        if (node->now_ms > scheduler.now_ms) {
+            scheduler.now_ms = node->now_ms;
+        }
+        tip_moved = tip_moved || node->tip_moved;
+    }
+    if (tip_moved) {
+        forget_confirmed_transactions();
+    }
+    scheduler.rounds++;
+}
 
-                // Reset for next block
-                pthread_mutex_lock(&transaction_lock);
-                pending_transaction_count = 0;
-                mining = false;
-                pthread_mutex_unlock(&transaction_lock);
+// Processes every event due by `end_ms` in order, then leaves the clock there. Transaction
+// arrivals run alone and before node events due at the same time: all those due at one time
+// are queued before admission is awaited once, so it validates them as a batch.
+void run_until(double end_ms) {
+    Node** active = (Node**)malloc(sizeof(Node*) * (size_t)num_nodes);
+    while (true) {
+        const Event* next = scheduler.events.count > 0 ? &scheduler.events.heap[0] : NULL;
+        const Event* arrival = scheduler.arrivals.count > 0 ? &scheduler.arrivals.heap[0] : NULL;
+        if (arrival && arrival->at <= end_ms && (next == NULL || arrival->at <= next->at)) {
+            double at = arrival->at;
+            while (scheduler.arrivals.count > 0 && scheduler.arrivals.heap[0].at == at) {
+                Event event = event_queue_pop(&scheduler.arrivals);
+                add_transaction(event.tx);
+                scheduler.processed++;
+            }
+            scheduler.now_ms = at;
+            wait_for_admission();
+            for (int i = 0; i < num_nodes; i++) {
+                start_mining(&network[i]);
             }
+            continue;
         }
-        pthread_mutex_unlock(&mining_lock);
+        if (next == NULL || next->at > end_ms) break;
+
+        // No message sent in the round can arrive before it ends
+        double round_end = next->at + transport.lookahead_ms;
+        if (round_end <= next->at) round_end = nextafter(next->at, INFINITY);
+        if (arrival && arrival->at < round_end) round_end = arrival->at;
+        double limit = nextafter(end_ms, INFINITY);
+        if (limit < round_end) round_end = limit;
+        run_round(round_end, active);
+    }
+    free(active);
+    if (end_ms > scheduler.now_ms) {
+        scheduler.now_ms = end_ms;
     }
+}
 
-    return NULL;
+void run_for(double ms) {
+    run_until(scheduler.now_ms + ms);
+}
+
+// A client submission arriving at the current simulated time
+void submit_transaction(Transaction tx) {
+    Event event;
+    memset(&event, 0, sizeof(event));
+    event.at = sim_now_ms();
+    event.type = EVENT_TRANSACTION;
+    event.tx = tx;
+    schedule_event(&event);
 }
 
-void init_network(bool with_malicious, int malicious_count) {
-    // Initialize accounts
-    for (int i = 0; i < NUM_NODES; i++) {
-        sprintf(accounts[i].address, "Node%d", i);
-        accounts[i].balance = INITIAL_BALANCE;
+// Every node starts from the same allocation, as the state genesis produces; the nodes share
+// it until they change it
+StateSnapshot* create_genesis_state() {
+    StateSnapshot* state = state_create();
+    pthread_rwlock_wrlock(&accounts.lock);
+    for (int j = 0; j < num_nodes; j++) {
+        state_set(state, account_id_or_create(&accounts, &network[j].address), INITIAL_BALANCE);
+    }
+    pthread_rwlock_unlock(&accounts.lock);
+    return state;
+}
+
+// `scenario` names the scenario's directory under the data directory
+void init_network(const char* scenario, bool with_malicious, int malicious_count) {
+    network = (Node*)calloc((size_t)num_nodes, sizeof(Node));
+    account_directory_init(&accounts, (size_t)num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        char name[ADDRESS_NAME_SIZE];
+        snprintf(name, sizeof(name), "Node%d", i);
+        network[i].address = register_name(name);
+    }
+
+    // Start from an empty pool, with wallets that have signed nothing on this network yet
+    pthread_mutex_lock(&transaction_lock);
+    mempool_init(&mempool);
+    pthread_mutex_unlock(&transaction_lock);
+    pthread_mutex_lock(&name_lock);
+    for (size_t e = 0; e < address_names.count; e++) {
+        address_names.entries[e].next_nonce = 0;
     }
+    pthread_mutex_unlock(&name_lock);
 
-    // Create genesis block and initialize nodes
-    Block* genesis = create_genesis_block();
+    // Every scenario replays the same simulated history for a given seed
+    scheduler_init();
+    worker_pool_init(&validation_pool, online_cpus());
+    signature_cache_init(&signature_cache, SIGNATURE_CACHE_SLOTS);
+    worker_pool_init(&mining_pool, miner_threads > 0 ? miner_threads : online_cpus());
+    mining_searches = 0;
+    mining_hashes = 0;
+    mining_seconds = 0.0;
+    worker_pool_init(&node_pool, online_cpus());
+    transport_init();
 
-    for (int i = 0; i < NUM_NODES; i++) {
+    // Initialize nodes, then give them all the same genesis block before any of them mines
+    for (int i = 0; i < num_nodes; i++) {
         network[i].id = i;
-        network[i].running = true;
-        network[i].blockchain.head = NULL;
-        network[i].blockchain.tail = NULL;
-        network[i].blockchain.length = 0;
-        network[i].blockchain.current_proof = 0;
-        network[i].total_rewards = 0.0;
+        network[i].mining = false;
+        network[i].mining_generation = 0;
+        network[i].skipping = false;
+        network[i].nonce_searches = 0;
+        network[i].stale_candidates = 0;
+        network[i].orphaned_blocks = 0;
+        network[i].reorgs = 0;
+        network[i].deepest_reorg = 0;
+        atomic_init(&network[i].tip_work, 0);
         network[i].is_malicious = with_malicious && (i < malicious_count); // Set malicious flag
+        network[i].rng = mix_seed(sim_seed ^ mix_seed((uint64_t)i)) | 1;   // xorshift never leaves 0
+        byte_buffer_init(&network[i].output);
         pthread_mutex_init(&network[i].blockchain.lock, NULL);
+        chain_init(&network[i].blockchain);
+        network[i].orphan_count = 0;
+        memset(&network[i].log, 0, sizeof(network[i].log));
+        pthread_mutex_init(&network[i].checkpoint_lock, NULL);
+        network[i].checkpoint_height = 0;
+        if (data_dir) {
+            // One directory per scenario, so no scenario starts on another's chain
+            char dir[PATH_SIZE];
+            snprintf(dir, sizeof(dir), "%s/%s/node%d", data_dir, scenario, i);
+            if (!block_log_open(&network[i].log, dir)) {
+                printf("Node %d cannot open a block log in %s, keeping its chain in memory only\n", i, dir);
+            }
+        }
+        arena_init(&network[i].blocks);
+        network[i].candidate = NULL;
+        network[i].candidate_capacity = 0;
+        merkle_init(&network[i].merkle);
+    }
 
-        add_block_to_chain(&network[i], genesis, 0);
-
-        pthread_create(&network[i].thread, NULL, mine_block, &network[i]);
+    // Persistent nodes reload what they had accepted; the rest start from the genesis they share with them
+    const Block* genesis = NULL;
+    StateSnapshot* genesis_state = create_genesis_state();
+    bool* restored = (bool*)malloc(sizeof(bool) * (size_t)num_nodes);
+    for (int i = 0; i < num_nodes; i++) {
+        restored[i] = restore_chain(&network[i], state_retain(genesis_state));
+        if (restored[i] && genesis == NULL) {
+            genesis = network[i].blockchain.base == 0 ? block_retain(chain_at(&network[i].blockchain, 0))
+                                                      : block_log_read(&network[i].log, 0, &network[i].blocks);
+        }
     }
-    free(genesis);
+    if (genesis == NULL) {
+        genesis = create_genesis_block(&network[0].blocks);
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        if (!restored[i]) {
+            add_block_to_chain(&network[i], genesis, state_retain(genesis_state));
+            if (block_log_enabled(&network[i].log)) {
+                block_log_append(&network[i].log, genesis);
+            }
+        }
+    }
+    block_release(genesis);
+    state_release(genesis_state);
+    free(restored);
+
+    // Admission checks against a node's state, so it starts once the nodes have one
+    tx_queue_init(&submission_queue, SUBMISSION_QUEUE_CAPACITY);
+    atomic_store(&admitted_count, 0);
+    atomic_store(&admission_running, true);
+    pthread_create(&admission_thread, NULL, admit_transactions, NULL);
 }
 
 void stop_network() {
-    for (int i = 0; i < NUM_NODES; i++) {
-        network[i].running = false;
+    // Let the admission thread drain what was already submitted before it exits
+    pthread_mutex_lock(&admission_lock);
+    atomic_store(&admission_running, false);
+    pthread_cond_signal(&admission_cond);
+    pthread_mutex_unlock(&admission_lock);
+    pthread_join(admission_thread, NULL);
+    tx_queue_free(&submission_queue);
+
+    // Whatever the clock had not reached yet never happens: candidates are not found and
+    // messages in flight are lost
+    printf("\nSimulated %.3fs in %llu events over %llu rounds (%zu still pending)\n", sim_now_ms() / 1000.0,
+          (unsigned long long)scheduler.processed, (unsigned long long)scheduler.rounds, scheduler.events.count);
+    scheduler_free();
+    print_transport_stats();
+    for (int i = 0; i < num_nodes; i++) {
+        for (int j = 0; j < network[i].orphan_count; j++) {
+            block_release(network[i].orphans[j]);
+        }
+        network[i].orphan_count = 0;
+    }
+
+    // A checkpoint of every tip lets the next start skip replay altogether
+    for (int i = 0; i < num_nodes; i++) {
+        if (!block_log_enabled(&network[i].log)) continue;
+        CheckpointTip tip;
+        pthread_mutex_lock(&network[i].blockchain.lock);
+        bool captured = capture_checkpoint(&network[i], &tip);
+        pthread_mutex_unlock(&network[i].blockchain.lock);
+        if (captured) {
+            write_checkpoint(&network[i], &tip);
+        }
     }
 
-    pthread_cond_broadcast(&transaction_cond);
+    // Chains reference blocks in every node's arena, so nothing is released until all have stopped
+    size_t allocations = 0, bytes = 0, reserved = 0, chunks = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        allocations += network[i].blocks.allocations;
+        bytes += network[i].blocks.bytes;
+        reserved += network[i].blocks.reserved;
+        chunks += network[i].blocks.chunk_count;
+    }
+    printf("\nReleasing %d arenas: %zu allocations, %zu bytes used of %zu reserved in %zu chunks\n",
+          num_nodes, allocations, bytes, reserved, chunks);
 
-    for (int i = 0; i < NUM_NODES; i++) {
-        pthread_join(network[i].thread, NULL);
+    for (int i = 0; i < num_nodes; i++) {
+        merkle_free(&network[i].merkle);
+        pthread_mutex_destroy(&network[i].blockchain.lock);
+        free(network[i].candidate);
 
-        Block* current = network[i].blockchain.head;
-        while (current != NULL) {
-            Block* next = current->next;
-            free(current);
-            current = next;
-        }
+        chain_free(&network[i].blockchain);
+        block_log_close(&network[i].log);
+        link_table_free(&network[i].links);
+        free(network[i].mailbox.heap);
+        free(network[i].outbox.heap);
+        byte_buffer_free(&network[i].output);
+        pthread_mutex_destroy(&network[i].checkpoint_lock);
+        arena_release(&network[i].blocks);
     }
+    atomic_store(&block_store.blocks, 0);
+    atomic_store(&block_store.bytes, 0);
+
+    worker_pool_destroy(&validation_pool);
+    signature_cache_free(&signature_cache);
+    worker_pool_destroy(&mining_pool);
+    worker_pool_destroy(&node_pool);
+    account_directory_free(&accounts);
+    mempool_free(&mempool);
+    free(network);
+    network = NULL;
 }
 
 void print_blockchain() {
     printf("\nBlockchain:\n");
-    for (int i = 0; i < NUM_NODES; i++) {
-        printf("Node %d chain (length %d, current proof: %ld):\n",
-              i, network[i].blockchain.length, network[i].blockchain.current_proof);
-        Block* current = network[i].blockchain.head;
-        while (current != NULL) {
-            printf("  Block %d [%s]\n", current->index, current->hash);
-            for (int j = 0; j < TRANSACTIONS_PER_BLOCK; j++) {
-                if (strlen(current->transactions[j].sender) > 0) {
-                    printf("    %s -> %s: %.2f\n",
-                          current->transactions[j].sender,
-                          current->transactions[j].receiver,
-                          current->transactions[j].amount);
+    size_t referenced_bytes = 0;
+    int same_tip = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        pthread_mutex_lock(&network[i].blockchain.lock);
+        Blockchain* chain = &network[i].blockchain;
+        if (i >= MAX_REPORTED_NODES) {
+            // The rest are only compared with node 0
+            for (int h = chain->base; h < chain->length; h++) {
+                referenced_bytes += block_size(chain_at(chain, h)->tx_count);
+            }
+            same_tip += memcmp(chain_tip(chain)->hash, chain_tip(&network[0].blockchain)->hash, HASH_SIZE) == 0;
+            pthread_mutex_unlock(&network[i].blockchain.lock);
+            continue;
+        }
+        printf("Node %d chain (length %d, %d blocks on side branches):\n", i, chain->length,
+              chain->entry_count - (chain->length - chain->base));
+        if (chain->base > 0) {
+            printf("  Blocks 0-%d are only in the block log, below the checkpoint this node restarted from\n",
+                  chain->base - 1);
+        }
+        for (int h = chain->base; h < chain->length; h++) {
+            const Block* current = chain_at(&network[i].blockchain, h);
+            referenced_bytes += block_size(current->tx_count);
+            char hash_hex[HASH_HEX_SIZE];
+            hash_to_hex(current->hash, hash_hex);
+            printf("  Block %d [%s] nonce %llu\n",
+                  current->index, hash_hex, (unsigned long long)current->nonce);
+            for (int j = 0; j < current->tx_count; j++) {
+                const Transaction* tx = &current->transactions[j];
+                char sender[ADDRESS_NAME_SIZE];
+                char receiver[ADDRESS_NAME_SIZE];
+                format_address(&tx->sender, sender);
+                format_address(&tx->receiver, receiver);
+                char amount[AMOUNT_TEXT_SIZE];
+                char fee[AMOUNT_TEXT_SIZE];
+                format_amount(tx->amount, amount);
+                format_amount(tx->fee, fee);
+                if (j == 0) {
+                    printf("    %s -> %s: %s\n", sender, receiver, amount);
+                } else {
+                    printf("    %s -> %s: %s (fee %s, nonce %llu)\n",
+                           sender, receiver, amount, fee, (unsigned long long)tx->nonce);
                 }
             }
-            current = current->next;
         }
+        pthread_mutex_unlock(&network[i].blockchain.lock);
+    }
+    if (num_nodes > MAX_REPORTED_NODES) {
+        printf("%d more nodes, %d of them on the same tip as node 0\n", num_nodes - MAX_REPORTED_NODES, same_tip);
+    }
+
+    printf("Block store: %zu blocks in %zu bytes (%zu bytes as per-node copies)\n",
+          atomic_load(&block_store.blocks), atomic_load(&block_store.bytes), referenced_bytes);
+}
+
+// What a light client does: check one transaction against a header without the other transactions
+void verify_transaction_inclusion(const Block* block, int tx_index) {
+    MerkleTree tree;
+    MerkleProof proof;
+    uint8_t leaf[HASH_SIZE];
+    merkle_init(&tree);
+
+    merkle_build(&tree, block->transactions, block->tx_count);
+    if (merkle_proof(&tree, tx_index, &proof)) {
+        const Transaction* tx = &block->transactions[tx_index];
+        char sender[ADDRESS_NAME_SIZE];
+        char receiver[ADDRESS_NAME_SIZE];
+        format_address(&tx->sender, sender);
+        format_address(&tx->receiver, receiver);
+        char amount[AMOUNT_TEXT_SIZE];
+        format_amount(tx->amount, amount);
+        merkle_leaf_hash(tx, leaf);
+        printf("Inclusion proof for %s -> %s (%s) in block %d: %s (%d hashes)\n",
+              sender, receiver, amount, block->index,
+              merkle_verify(leaf, &proof, block->merkle_root) ? "valid" : "INVALID", proof.length);
+    }
+
+    merkle_free(&tree);
+}
+
+void print_mining_stats() {
+    printf("\nMining Throughput:\n");
+    double rate = mining_seconds > 0 ? mining_hashes / mining_seconds : 0.0;
+    printf("Mining pool (%d threads): %d searches, %llu hashes in %.3fs (%.2f MH/s, %.2f MH/s per thread)\n",
+          mining_pool.size, mining_searches, (unsigned long long)mining_hashes, mining_seconds,
+          rate / 1e6, rate / 1e6 / mining_pool.size);
+    int other_searches = 0, other_stale = 0, other_orphaned = 0, other_reorgs = 0, other_deepest = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (i >= MAX_REPORTED_NODES) {
+            other_searches += network[i].nonce_searches;
+            other_stale += network[i].stale_candidates;
+            other_orphaned += network[i].orphaned_blocks;
+            other_reorgs += network[i].reorgs;
+            if (network[i].deepest_reorg > other_deepest) other_deepest = network[i].deepest_reorg;
+            continue;
+        }
+        printf("Node %d: %d nonce searches, %d stale candidates abandoned, %d mined blocks orphaned, %d reorgs (deepest %d)\n",
+              i, network[i].nonce_searches, network[i].stale_candidates, network[i].orphaned_blocks,
+              network[i].reorgs, network[i].deepest_reorg);
+    }
+    if (num_nodes > MAX_REPORTED_NODES) {
+        printf("%d more nodes: %d nonce searches, %d stale candidates abandoned, %d mined blocks orphaned, %d reorgs (deepest %d)\n",
+              num_nodes - MAX_REPORTED_NODES, other_searches, other_stale, other_orphaned,
+              other_reorgs, other_deepest);
     }
 }
 
+// Balances at the tip of the reference node's best chain
 void print_balances() {
     printf("\nAccount Balances:\n");
-    for (int i = 0; i < NUM_NODES; i++) {
-        printf("%s: %.2f\n", accounts[i].address, accounts[i].balance);
+    Node* node = reference_node();
+    StateSnapshot* state = chain_tip_state(&node->blockchain);
+    int listed = 0, others = 0;
+    Amount other_balance = 0;
+    char text[AMOUNT_TEXT_SIZE];
+    pthread_rwlock_rdlock(&accounts.lock);
+    for (size_t id = 0; id < accounts.count; id++) {
+        Amount balance;
+        if (!state_get(state, id, &balance)) continue;
+        if (listed == MAX_REPORTED_NODES) {
+            others++;
+            other_balance += balance;
+            continue;
+        }
+        char name[ADDRESS_NAME_SIZE];
+        format_address(&accounts.addresses[id], name);
+        format_amount(balance, text);
+        printf("%s: %s\n", name, text);
+        listed++;
     }
+    pthread_rwlock_unlock(&accounts.lock);
+    if (others > 0) {
+        format_amount(other_balance, text);
+        printf("%d more accounts holding %s\n", others, text);
+    }
+    state_release(state);
 }
 
 void test_part1_valid_transactions() {
     printf("\n=== PART 1: TESTING VALID TRANSACTIONS ===\n");
 
     // Initialize network with no malicious nodes
-    init_network(false, 0);
-
-    // Create valid transactions
-    Transaction tx1 = {"Node0", "Node1", 10.0, time(NULL)};
-    Transaction tx2 = {"Node1", "Node2", 5.0, time(NULL)};
-    Transaction tx3 = {"Node2", "Node3", 15.0, time(NULL)};
-    Transaction tx4 = {"Node3", "Node4", 8.0, time(NULL)};
-    Transaction tx5 = {"Node4", "Node5", 12.0, time(NULL)};
-    Transaction tx6 = {"Node5", "Node6", 7.0, time(NULL)};
-    Transaction tx7 = {"Node6", "Node5", 10.0, time(NULL)};
-    Transaction tx8 = {"Node7", "Node4", 5.0, time(NULL)};
-    Transaction tx9 = {"Node1", "Node3", 15.0, time(NULL)};
+    init_network("valid", false, 0);
+
+    // Create valid transactions; blocks order them by fee
+    Transaction tx1 = make_transaction("Node0", "Node1", 10 * COIN, 10 * CENT);
+    Transaction tx2 = make_transaction("Node1", "Node2", 5 * COIN, 50 * CENT);
+    Transaction tx3 = make_transaction("Node2", "Node3", 15 * COIN, 25 * CENT);
+    Transaction tx4 = make_transaction("Node3", "Node4", 8 * COIN, 5 * CENT);
+    Transaction tx5 = make_transaction("Node4", "Node5", 12 * COIN, 20 * CENT);
+    Transaction tx6 = make_transaction("Node5", "Node6", 7 * COIN, 15 * CENT);
+    Transaction tx7 = make_transaction("Node6", "Node5", 10 * COIN, 30 * CENT);
+    Transaction tx8 = make_transaction("Node7", "Node4", 5 * COIN, 10 * CENT);
+    Transaction tx9 = make_transaction("Node1", "Node3", 15 * COIN, 40 * CENT);
     printf("Adding transactions...\n");
-    add_transaction(tx1);
-    add_transaction(tx2);
-    add_transaction(tx3);
-    sleep(2);
-
-    add_transaction(tx4);
-    add_transaction(tx5);
-    add_transaction(tx6);
-    sleep(2);
-    add_transaction(tx7);
-    add_transaction(tx8);
-    add_transaction(tx9);
-    sleep(2);
+    submit_transaction(tx1);
+    submit_transaction(tx2);
+    submit_transaction(tx3);
+    run_for(2000);
+
+    // The chain has used tx1's nonce, so the same signed transaction cannot be replayed
+    printf("\nReplaying the first transaction...\n");
+    submit_transaction(tx1);
+    run_for(0);
+
+    submit_transaction(tx4);
+    submit_transaction(tx5);
+    submit_transaction(tx6);
+    run_for(2000);
+    submit_transaction(tx7);
+    submit_transaction(tx8);
+    submit_transaction(tx9);
+    run_for(2000);
+
+    // Check a transaction of the first mined block the way a light client would
+    pthread_mutex_lock(&network[0].blockchain.lock);
+    const Block* first_mined = chain_at(&network[0].blockchain, 1);
+    if (first_mined) {
+        verify_transaction_inclusion(first_mined, 1);
+    }
+    pthread_mutex_unlock(&network[0].blockchain.lock);
 
     // Display blockchain state for each node
     print_blockchain();
     print_balances();
     print_rewards();
+    print_mining_stats();
 
-    //stop_network();
+    stop_network();
 }
 
 void test_part2_invalid_transactions() {
     printf("\n=== PART 2: TESTING INVALID TRANSACTIONS ===\n");
 
     // Initialize network with no malicious nodes
-    init_network(false, 0);
+    init_network("invalid", false, 0);
 
     // Create both valid and invalid transactions
-    Transaction valid_tx = {"Node0", "Node1", 10.0, time(NULL)};
-    Transaction invalid_tx1 = {"Node0", "Node1", 200.0, time(NULL)}; // Too much
-    Transaction invalid_tx2 = {"NodeX", "Node1", 5.0, time(NULL)};    // Invalid sender
+    Transaction valid_tx = make_transaction("Node0", "Node1", 10 * COIN, 10 * CENT);
+    Transaction bumped_tx = valid_tx;                                            // Same nonce, higher fee
+    bumped_tx.fee = 50 * CENT;
+    sign_transaction(&bumped_tx);
+    Transaction spend_tx = make_transaction("Node0", "Node2", 60 * COIN, 10 * CENT);
+    Transaction double_spend_tx = make_transaction("Node0", "Node3", 60 * COIN, 10 * CENT);  // Only with spend_tx pending
+    Transaction invalid_tx1 = make_transaction("Node0", "Node1", 200 * COIN, 10 * CENT);  // Too much
+    Transaction invalid_tx2 = make_transaction("NodeX", "Node1", 5 * COIN, 10 * CENT);    // Invalid sender
+    Transaction forged_tx = make_transaction("NodeX", "Node1", 5 * COIN, 10 * CENT);
+    forged_tx.sender = register_name("Node0");                                   // Signed with NodeX's key
 
     printf("Adding valid transaction...\n");
-    add_transaction(valid_tx);
+    submit_transaction(valid_tx);
+    run_for(0);
+
+    printf("\nResubmitting it with a higher fee, then the original again...\n");
+    submit_transaction(bumped_tx);
+    run_for(0);
+    submit_transaction(valid_tx);
+    run_for(0);
+
+    printf("\nAttempting to spend Node0's remaining funds twice while both are pending...\n");
+    submit_transaction(spend_tx);
+    submit_transaction(double_spend_tx);
+    run_for(0);
 
     printf("\nAttempting invalid transaction (insufficient funds)...\n");
-    add_transaction(invalid_tx1);
+    submit_transaction(invalid_tx1);
+    run_for(0);
 
     printf("\nAttempting invalid transaction (unknown sender)...\n");
-    add_transaction(invalid_tx2);
+    submit_transaction(invalid_tx2);
+    run_for(0);
 
-    sleep(2);
+    printf("\nAttempting forged transaction (spends Node0's funds with another key)...\n");
+    submit_transaction(forged_tx);
+    run_for(0);
+
+    run_for(2000);
 
     // Display blockchain state - should only show the valid transaction
     print_blockchain();
     print_balances();
     print_rewards();
+    print_mining_stats();
 
-    //stop_network();
+    stop_network();
 }
 
 void test_part3_malicious_nodes(int malicious_count) {
     printf("\n=== PART 3: TESTING WITH %d MALICIOUS NODES ===\n", malicious_count);
 
     // Initialize network with specified number of malicious nodes
-    init_network(true, malicious_count);
+    char scenario[32];
+    snprintf(scenario, sizeof(scenario), "malicious-%d", malicious_count);
+    init_network(scenario, true, malicious_count);
 
     // Print which nodes are malicious
     printf("Malicious nodes: ");
-    for (int i = 0; i < NUM_NODES; i++) {
-        if (network[i].is_malicious) {
-            printf("%d ", i);
+    if (malicious_count > MAX_REPORTED_NODES) {
+        printf("0-%d of %d", malicious_count - 1, num_nodes);
+    } else {
+        for (int i = 0; i < num_nodes; i++) {
+            if (network[i].is_malicious) {
+                printf("%d ", i);
+            }
         }
     }
     printf("\n");
 
     // Create some transactions
-    Transaction tx1 = {"Node0", "Node1", 10.0, time(NULL)};
-    Transaction tx2 = {"Node1", "Node2", 5.0, time(NULL)};
-    Transaction tx3 = {"Node2", "Node3", 15.0, time(NULL)};
+    Transaction tx1 = make_transaction("Node0", "Node1", 10 * COIN, 10 * CENT);
+    Transaction tx2 = make_transaction("Node1", "Node2", 5 * COIN, 10 * CENT);
+    Transaction tx3 = make_transaction("Node2", "Node3", 15 * COIN, 10 * CENT);
 
     printf("Adding transactions to network with malicious nodes...\n");
-    add_transaction(tx1);
-    add_transaction(tx2);
-    add_transaction(tx3);
-    sleep(2);
+    submit_transaction(tx1);
+    submit_transaction(tx2);
+    submit_transaction(tx3);
+    run_for(2000);
 
     // Add more transactions to see behavior
-    Transaction tx4 = {"Node3", "Node4", 8.0, time(NULL)};
-    Transaction tx5 = {"Node4", "Node5", 12.0, time(NULL)};
-    add_transaction(tx4);
-    add_transaction(tx5);
-    sleep(2);
+    Transaction tx4 = make_transaction("Node3", "Node4", 8 * COIN, 10 * CENT);
+    Transaction tx5 = make_transaction("Node4", "Node5", 12 * COIN, 10 * CENT);
+    submit_transaction(tx4);
+    submit_transaction(tx5);
+    run_for(2000);
 
     // Display results
     print_blockchain();
     print_balances();
     print_rewards();
+    print_mining_stats();
+
+    stop_network();
+}
 
-    //stop_network();
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--seed N] [--nodes N] [--data-dir DIR | DIR]\n", program);
 }
 
-int main() {
-    srand(time(NULL));
+// An optional data directory makes nodes persist their chains there and reload them on start;
+// --seed picks the simulated history, which is otherwise the same on every run
+int main(int argc, char** argv) {
+    init_address_hash_key();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char* end;
+            errno = 0;
+            sim_seed = strtoull(argv[++i], &end, 0);
+            if (errno != 0 || end == argv[i] || *end != '\0') {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) {
+            char* end;
+            errno = 0;
+            long nodes = strtol(argv[++i], &end, 10);
+            if (errno != 0 || end == argv[i] || *end != '\0' || nodes < 1 || nodes > INT_MAX) {
+                fprintf(stderr, "Invalid node count: %s\n", argv[i]);
+                return 2;
+            }
+            num_nodes = (int)nodes;
+        } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if (argv[i][0] != '-' && data_dir == NULL) {
+            data_dir = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+    sha256_select_engine();
+    printf("SHA-256 engine: %s\n", sha256_engine_name);
 
     // Part 1: Test valid transactions
     test_part1_valid_transactions();
@@ -498,11 +5785,11 @@ int main() {
     test_part2_invalid_transactions();
 
     // Part 3: Test with malicious nodes
-    // First with <50% malicious nodes (2 out of 8)
-    test_part3_malicious_nodes(2);
+    // First with <50% malicious nodes (2 out of 8 by default)
+    test_part3_malicious_nodes(num_nodes / 4);
 
-    // Then with >50% malicious nodes (5 out of 8)
-    test_part3_malicious_nodes(5);
+    // Then with >50% malicious nodes (5 out of 8 by default)
+    test_part3_malicious_nodes(num_nodes * 5 / 8);
 
     return 0;
 }
\ No newline at end of file